@@ -1,35 +1,75 @@
 #include <iostream>
-#include "../common/Rotation.h"
-#include "../common/CameraModel.h"
-#include "../common/ModelDataProducer.h"
+#include <cerrno>
+#include "../common/SyntheticDataFactory.h"
+#include "../common/ModelDataset.h"
 
 
-int pairNum = 300, trialNum = 500;
-double sigma = 0.0, translateLen = 0.0;
+SyntheticDataConfig config;
+bool binaryFormat = false;
+
+//parse the whole str as a number, return false if anything is left after it
+bool parseNumber(const char *str, double &value)
+{
+	char *end = NULL;
+	value = strtod(str, &end);
+	return end != str && *end == '\0';
+}
+
+bool parseNumber(const char *str, int &value)
+{
+	char *end = NULL;
+	long result = strtol(str, &end, 10);
+	value = int(result);
+	return end != str && *end == '\0' && result == value;
+}
+
+bool parseNumber(const char *str, uint64_t &value)
+{
+	char *end = NULL;
+	errno = 0;
+	value = strtoull(str, &end, 10);
+	return end != str && *end == '\0' && str[0] != '-' && errno != ERANGE;
+}
 
 int parseCmdArgs(int argc, char** argv)
 {
+	const char *usage = "Usage: CameraDataFactory [-pairNum n] [-trialNum n] [-sigma s] [-tl len] [-seed n] [-binary]";
 	for (int i = 1; i < argc; i++)
 	{
-		if (std::string(argv[i]) == "-pairNum")
+		std::string arg = argv[i];
+		if (arg == "-binary")
 		{
-			pairNum = atof(argv[i + 1]);
-			i++;
+			binaryFormat = true;
+			continue;
 		}
-		else if (std::string(argv[i]) == "-sigma")
-		{
-			sigma = atof(argv[i + 1]);
-			i++;
-		}
-		else if (std::string(argv[i]) == "-tl")
+		if (arg != "-pairNum" && arg != "-sigma" && arg != "-tl" && arg != "-seed" && arg != "-trialNum")
+			continue;
+
+		if (i + 1 >= argc)
 		{
-			translateLen = atof(argv[i + 1]);
-			i++;
+			std::cout << "Missing the value after " << arg << std::endl;
+			std::cout << usage << std::endl;
+			return -1;
 		}
-		else if (std::string(argv[i]) == "-trialNum")
+
+		const char *value = argv[++i];
+		bool valid;
+		if (arg == "-pairNum")
+			valid = parseNumber(value, config.pairNum) && config.pairNum > 0;
+		else if (arg == "-sigma")
+			valid = parseNumber(value, config.sigma);
+		else if (arg == "-tl")
+			valid = parseNumber(value, config.translateLen);
+		else if (arg == "-seed")
+			valid = parseNumber(value, config.seed);
+		else
+			valid = parseNumber(value, config.trialNum) && config.trialNum > 0;
+
+		if (!valid)
 		{
-			trialNum = atof(argv[i + 1]);
-			i++;
+			std::cout << "Invalid value " << value << " after " << arg << std::endl;
+			std::cout << usage << std::endl;
+			return -1;
 		}
 	}
 
@@ -39,34 +79,35 @@ int parseCmdArgs(int argc, char** argv)
 
 int main(int argc, char *argv[])
 {
-	parseCmdArgs(argc, argv);
-
-	std::cout << "pairNum : " << pairNum << std::endl;
-	std::cout << "trialNum : " << trialNum << std::endl;
-	std::cout << "sigma : " << sigma << std::endl;
-	std::cout << "translateLen : " << translateLen << std::endl;
-
-	std::string classicModelName[3] = { "Equidistant", "Equisolid", "Stereographic" };
-	double minFocal = 400, maxFocal = 600;
-	double minFov = CV_PI * (160 / 180.0), maxFov = CV_PI * (200 / 180.0);
-	double minAngle = CV_PI * (70 / 180.0), maxAngle = CV_PI * (110 / 180.0);
+	config.seed = uint64_t(time(NULL));
+	if (parseCmdArgs(argc, argv) != 0)
+	{
+		return -1;
+	}
 
-	std::ofstream fs("SyntheticData.txt", std::ios::out);
-	fs << trialNum << std::endl;
-	ModelDataProducer producer;
-	srand(time(NULL));
+	std::cout << "pairNum : " << config.pairNum << std::endl;
+	std::cout << "trialNum : " << config.trialNum << std::endl;
+	std::cout << "sigma : " << config.sigma << std::endl;
+	std::cout << "translateLen : " << config.translateLen << std::endl;
+	std::cout << "seed : " << config.seed << std::endl;
 
-	for (size_t i = 0; i < trialNum; i++)
+	if (binaryFormat)
 	{
-		double fov = RandomInRange(minFov, maxFov);
-		double f = RandomInRange(minFocal, maxFocal);
-		int typeIdx = RandomInRange(0, 3);
-
-		std::shared_ptr<CameraModel> pModel = createCameraModel(classicModelName[typeIdx], 0, 0, f, fov, 0);/*std::make_shared<Stereographic>(0, 0, f, fov)*/;
-		std::shared_ptr<Rotation> pRotation = std::make_shared<Rotation>(minAngle, maxAngle);
-		producer.produce(pModel, pRotation, pairNum, sigma, translateLen);
-		producer.writeToFile(fs);
+		ModelDataset::Writer writer("SyntheticData.bin");
+		if (!writer.isOpened())
+		{
+			std::cout << "Failed to open the file SyntheticData.bin" << std::endl;
+			return -1;
+		}
+		SyntheticDataFactory(config).generate([&](int trial, const std::shared_ptr<ModelDataProducer> &pModelData)
+		{
+			writer.write(*pModelData);
+		});
+		writer.close();
+	}
+	else
+	{
+		SyntheticDataFactory(config).generate("SyntheticData.txt");
 	}
-	fs.close();
 	return 0;
 }
\ No newline at end of file
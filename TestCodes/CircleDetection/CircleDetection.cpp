@@ -1,5 +1,4 @@
 #include <OpencvCommon.h>
-#include <Ransac.h>
 #include <memory>
 #include <ctime>
 
@@ -26,12 +25,315 @@ public:
 	virtual Circle detect(const cv::Mat &img) = 0;
 };
 
+//The gray values of one image row. A 3-channel row is converted on demand in chunks
+//with the fixed-point BGR2GRAY coefficients of cv::cvtColor, the scans read the row
+//from the two sides toward the center, so only the pixels they read are converted
+//and each of them once. A 1-channel row is read directly
+class GrayRow
+{
+public:
+	GrayRow() : mpRow(NULL), mChannels(1), mCols(0), mLeftBegin(0), mLeftEnd(0), mRightBegin(0), mRightEnd(0) {}
+	~GrayRow() {}
+
+	void attach(const cv::Mat &img, int row)
+	{
+		assert(img.type() == CV_8UC3 || img.type() == CV_8UC1);
+		mpRow = img.ptr(row);
+		mChannels = img.channels();
+		mCols = img.cols;
+		if (mChannels != 1 && int(mvGray.size()) < mCols) mvGray.resize(mCols);
+		mLeftBegin = mLeftEnd = mRightBegin = mRightEnd = 0;
+	}
+
+	//the gray value at x, the left span grows to the right and the right span to the left,
+	//the other reads are converted one by one
+	int at(int x)
+	{
+		if (mChannels == 1) return mpRow[x];
+		if ((x >= mLeftBegin && x < mLeftEnd) || (x >= mRightBegin && x < mRightEnd)) return mvGray[x];
+
+		if (mLeftBegin == mLeftEnd || x == mLeftEnd)
+		{
+			if (mLeftBegin == mLeftEnd) mLeftBegin = x;
+			mLeftEnd = std::min(x + CHUNK, mCols);
+			_convert(x, mLeftEnd);
+		}
+		else if (mRightBegin == mRightEnd || x == mRightBegin - 1)
+		{
+			if (mRightBegin == mRightEnd) mRightEnd = x + 1;
+			mRightBegin = std::max(x + 1 - CHUNK, 0);
+			_convert(mRightBegin, x + 1);
+		}
+		else return GrayPixel(mpRow + x * 3);
+		return mvGray[x];
+	}
+
+	//the same rounding as cv::cvtColor, Y = (1868 * B + 9617 * G + 4899 * R + 2^13) >> 14
+	static int GrayPixel(const uchar *p)
+	{
+		return (p[0] * 1868 + p[1] * 9617 + p[2] * 4899 + (1 << 13)) >> 14;
+	}
+
+private:
+	enum { CHUNK = 64 };
+
+	//the loop has no dependency between the pixels so the compiler is free to vectorize it
+	void _convert(int x0, int x1)
+	{
+		const uchar *p = mpRow + x0 * 3;
+		uchar *dst = mvGray.data();
+		for (int x = x0; x < x1; x++, p += 3)
+		{
+			dst[x] = uchar((p[0] * 1868 + p[1] * 9617 + p[2] * 4899 + (1 << 13)) >> 14);
+		}
+	}
+
+	const uchar *mpRow;
+	int mChannels, mCols;
+	//the converted spans [mLeftBegin, mLeftEnd) and [mRightBegin, mRightEnd)
+	int mLeftBegin, mLeftEnd, mRightBegin, mRightEnd;
+	std::vector<uchar> mvGray;
+};
+
+//The algebraic circle fit of Taubin, solved by the Newton iterations of Chernov,
+//the coordinates are centered for the conditioning. mask selects the points if not NULL.
+//Chernov, Circular and Linear Regression: Fitting Circles and Lines by Least Squares, 2010
+inline bool FitCircleTaubin(const std::vector<cv::Point2i> &points, const char *mask,
+							double &x, double &y, double &radius_sq)
+{
+	int num = int(points.size()), count = 0;
+	double meanX = 0, meanY = 0;
+	for (int i = 0; i < num; i++)
+	{
+		if (mask != NULL && !mask[i]) continue;
+		meanX += points[i].x;
+		meanY += points[i].y;
+		count++;
+	}
+	if (count < 3) return false;
+	meanX /= count;
+	meanY /= count;
+
+	double Mxx = 0, Myy = 0, Mxy = 0, Mxz = 0, Myz = 0, Mzz = 0;
+	for (int i = 0; i < num; i++)
+	{
+		if (mask != NULL && !mask[i]) continue;
+		double X = points[i].x - meanX, Y = points[i].y - meanY;
+		double Z = X * X + Y * Y;
+		Mxy += X * Y;
+		Mxx += X * X;
+		Myy += Y * Y;
+		Mxz += X * Z;
+		Myz += Y * Z;
+		Mzz += Z * Z;
+	}
+	Mxx /= count; Myy /= count; Mxy /= count;
+	Mxz /= count; Myz /= count; Mzz /= count;
+
+	//the characteristic polynomial of the generalized eigenproblem, its smallest root is
+	//found by the Newton iterations from 0
+	double Mz = Mxx + Myy;
+	double Cov_xy = Mxx * Myy - Mxy * Mxy;
+	double Var_z = Mzz - Mz * Mz;
+	double A3 = 4 * Mz;
+	double A2 = -3 * Mz * Mz - Mzz;
+	double A1 = Var_z * Mz + 4 * Cov_xy * Mz - Mxz * Mxz - Myz * Myz;
+	double A0 = Mxz * (Mxz * Myy - Myz * Mxy) + Myz * (Myz * Mxx - Mxz * Mxy) - Var_z * Cov_xy;
+	double A22 = A2 + A2, A33 = A3 + A3 + A3;
+
+	double root = 0, value = A0;
+	for (int iter = 0; iter < 99; iter++)
+	{
+		double Dy = A1 + root * (A22 + A33 * root);
+		double rootNew = root - value / Dy;
+		if (rootNew == root || !std::isfinite(rootNew)) break;
+		double valueNew = A0 + rootNew * (A1 + rootNew * (A2 + rootNew * A3));
+		if (fabs(valueNew) >= fabs(value)) break;
+		root = rootNew;
+		value = valueNew;
+	}
+
+	double det = root * root - root * Mz + Cov_xy;
+	if (fabs(det) < 1e-12) return false;
+	double cx = (Mxz * (Myy - root) - Myz * Mxy) / det / 2;
+	double cy = (Myz * (Mxx - root) - Mxz * Mxy) / det / 2;
+
+	x = cx + meanX;
+	y = cy + meanY;
+	radius_sq = cx * cx + cy * cy + Mz;
+	return true;
+}
+
+//RANSAC fit of a circle to the edge points, the hypotheses are the circles through 3 random
+//points and the inliers are the points within threshold pixels of the circle. The points are
+//read from the flat buffer and the mask is reused, so the fit does not allocate once warm.
+//The iterations stop once the best inlier ratio w gives the confidence,
+//log(1 - confidence) / log(1 - w^3) iterations, and the best circle is refitted on its inliers
+class CircleRansac
+{
+public:
+	CircleRansac(double threshold = 10, double confidence = 0.99, int maxIter = 2000, uint64 seed = 0x12345678) :
+		mThreshold(threshold), mConfidence(confidence), mMaxIter(maxIter), mSeed(seed), mCleanRatio(0.95),
+		mX(0), mY(0), mRadius2(0), mIterations(0) {}
+	~CircleRansac() {}
+
+	//the frames whose algebraic fit of all the points has at least cleanRatio inliers skip
+	//the sampling, 1 or above disables the shortcut
+	void setCleanRatio(double cleanRatio) { mCleanRatio = cleanRatio; }
+
+	//returns the inlier ratio, mask is 1 for the inliers of the final circle. It returns 0
+	//and the circle is reset to 0 when no circle is found (less than 3 points, all the
+	//samples are collinear or no hypothesis has any inlier)
+	double run(const std::vector<cv::Point2i> &points, std::vector<char> &mask)
+	{
+		int num = int(points.size());
+		mask.assign(num, 0);
+		mX = mY = mRadius2 = 0;
+		mIterations = 0;
+		if (num < 3) return 0;
+
+		//the clean frames are fitted directly
+		double x, y, r2;
+		if (mCleanRatio < 1 && FitCircleTaubin(points, NULL, x, y, r2) &&
+			_countInliers(points, x, y, r2, NULL) >= mCleanRatio * num)
+		{
+			mX = x;
+			mY = y;
+			mRadius2 = r2;
+			return _refine(points, mask);
+		}
+
+		//the same seed for every frame, the fit of the same points is reproducible
+		cv::RNG rng(mSeed);
+		int bestCount = -1;
+		int maxIter = mMaxIter;
+		for (int iter = 0; iter < maxIter; iter++)
+		{
+			mIterations++;
+			//3 distinct indices, i1 and i2 are drawn from the remaining ones and shifted
+			//past the taken indices in increasing order
+			int i0 = rng.uniform(0, num), i1 = rng.uniform(0, num - 1), i2 = rng.uniform(0, num - 2);
+			if (i1 >= i0) i1++;
+			if (i2 >= std::min(i0, i1)) i2++;
+			if (i2 >= std::max(i0, i1)) i2++;
+
+			if (!CircleFrom3Points(points[i0], points[i1], points[i2], x, y, r2)) continue;
+
+			int count = _countInliers(points, x, y, r2, NULL);
+			if (count > bestCount)
+			{
+				bestCount = count;
+				mX = x;
+				mY = y;
+				mRadius2 = r2;
+				maxIter = std::min(maxIter, _requiredIterations(count / double(num)));
+			}
+		}
+		if (bestCount <= 0)
+		{
+			mX = mY = mRadius2 = 0;
+			return 0;
+		}
+
+		return _refine(points, mask);
+	}
+
+	void getCircle(double &x, double &y, double &radius_sq) const
+	{
+		x = mX;
+		y = mY;
+		radius_sq = mRadius2;
+	}
+
+	//the hypotheses drawn by the last run, 0 for the clean frames
+	int getIterations() const { return mIterations; }
+
+	//the circumcircle of the 3 points, returns false if they are collinear
+	static bool CircleFrom3Points(const cv::Point2i &a, const cv::Point2i &b, const cv::Point2i &c,
+								  double &x, double &y, double &radius_sq)
+	{
+		double bx = b.x - a.x, by = b.y - a.y, cx = c.x - a.x, cy = c.y - a.y;
+		double d = 2 * (bx * cy - by * cx);
+		if (fabs(d) < 1e-9) return false;
+		double b2 = bx * bx + by * by, c2 = cx * cx + cy * cy;
+		double ux = (cy * b2 - by * c2) / d, uy = (bx * c2 - cx * b2) / d;
+		x = a.x + ux;
+		y = a.y + uy;
+		radius_sq = ux * ux + uy * uy;
+		return true;
+	}
+
+private:
+	int _requiredIterations(double inlierRatio) const
+	{
+		double w3 = inlierRatio * inlierRatio * inlierRatio;
+		if (w3 >= 1) return 1;
+		if (w3 <= 0) return mMaxIter;
+		double n = log(1 - mConfidence) / log(1 - w3);
+		return n < mMaxIter ? std::max(1, int(ceil(n))) : mMaxIter;
+	}
+
+	//the Taubin fit of the inliers of the current circle, kept if it does not lose inliers,
+	//the mask and the returned ratio are of the final circle
+	double _refine(const std::vector<cv::Point2i> &points, std::vector<char> &mask)
+	{
+		int num = int(points.size());
+		int count = _countInliers(points, mX, mY, mRadius2, mask.data());
+		double x, y, r2;
+		if (FitCircleTaubin(points, mask.data(), x, y, r2) &&
+			_countInliers(points, x, y, r2, NULL) >= count)
+		{
+			mX = x;
+			mY = y;
+			mRadius2 = r2;
+			count = _countInliers(points, mX, mY, mRadius2, mask.data());
+		}
+		return count / double(num);
+	}
+
+	//|d - r| < threshold is tested on the squared distance, (r - t)^2 < d^2 < (r + t)^2
+	int _countInliers(const std::vector<cv::Point2i> &points, double x, double y, double radius_sq, char *mask) const
+	{
+		double r = sqrt(radius_sq);
+		double lo = std::max(r - mThreshold, 0.0), hi = r + mThreshold;
+		lo *= lo;
+		hi *= hi;
+		int num = int(points.size()), count = 0;
+		for (int i = 0; i < num; i++)
+		{
+			double dx = points[i].x - x, dy = points[i].y - y;
+			double d2 = dx * dx + dy * dy;
+			char in = d2 > lo && d2 < hi;
+			count += in;
+			if (mask != NULL) mask[i] = in;
+		}
+		return count;
+	}
+
+	double mThreshold, mConfidence;
+	int mMaxIter;
+	uint64 mSeed;
+	double mCleanRatio;
+	double mX, mY, mRadius2;
+	int mIterations;
+};
+
 class RasterScanDetector : public CircleDetector
 {
 public:
-	RasterScanDetector() {}
+	//parallel scans the sampled rows with cv::parallel_for_, the edge points are the same
+	//as the serial scan's, in the same order
+	RasterScanDetector(bool parallel = false) : mbParallel(parallel), mInlierRatio(0) {}
 	~RasterScanDetector() {}
 
+	void setParallel(bool parallel) { mbParallel = parallel; }
+
+	//the inlier ratio of the last circle fit
+	double getInlierRatio() const { return mInlierRatio; }
+
+	//the found edges are moved outward by this many pixels, the tracker keeps the same circle
+	static int EdgeShift(int cols) { return cols / 2 / SHIFT_W_RATIO; }
+
 	virtual Circle detect(const cv::Mat &img)
 	{
 		cv::Point2d circle_center;
@@ -39,453 +341,547 @@ public:
 		_getCircleRegion(img, circle_center, radius);
 		return { circle_center, radius };
 	}
-	
+
 private:
+	//the parameters of the raster scan, derived from the image size and the boundary box
+	struct ScanParams
+	{
+		int W, H, half_W, half_H;
+		int step;
+		int shift_w, shift_h;
+		int window_width, grad_threshold, minX_threshold;
+		int edge_black, big_black, m_black;
+		int x_l, x_h, y_l, y_h;
+	};
+
+	//the edges found on the two sides of one row, dark is true if both sides are black to the center
+	struct RowEdges
+	{
+		int edge[2];
+		bool found[2];
+		bool dark;
+	};
+
+	//the scratch of one stripe of rows in the parallel scan
+	struct ScanStripe
+	{
+		GrayRow gray;
+		std::vector<int> row_integral;
+	};
+
+	enum { SCAN_STRIPE_NUM = 16, SHIFT_W_RATIO = 50 };
 
 	void _getCircleRegion(const cv::Mat &img, cv::Point2d &center, double &radius)
 	{
-		std::vector<std::vector<int> > circle_points;
-		_getCircleEdgePoints(img, circle_points);
+		_getCircleEdgePoints(img, mvEdgePoints);
 
-		RansacCircle ransaccircle(10, 0.99, 2000, false);
-		std::vector<char> inlier_mask;
-		double interior_rate = ransaccircle.run(circle_points, inlier_mask);
+		mInlierRatio = mRansac.run(mvEdgePoints, mvInlierMask);
 
 		double x, y, radius_s;
-		ransaccircle.getCircle(x, y, radius_s);
+		mRansac.getCircle(x, y, radius_s);
 
 		radius = sqrt(radius_s);
 		center = cv::Point2d(x, y);
-		circle_points.clear();
 	}
 
-	void _getCircleEdgePoints(const cv::Mat &img, std::vector<std::vector<int> >&circle_points)
+	void _getScanParams(const cv::Mat &img, ScanParams &sp)
 	{
-		if (!circle_points.empty())circle_points.clear();
 		double megapix = 0.5;
-		int edge_black = 25;
-		int big_black = 100;
-		int shift_w_ratio = 50;
 		int shift_h_ratio = 60;
 		int window_windth_raio = 6;
 		int grad_threshold_ratio = 20;
 		int minX_threshold_ratio = 100;
-		int m_black = 15;
+		sp.edge_black = 25;
+		sp.big_black = 100;
+		sp.m_black = 15;
 
 		double work_scale = std::min(1.0, sqrt(megapix * 1e6 / img.size().area()));
-		int step = 1.0 / work_scale;
+		sp.step = 1.0 / work_scale;
 
-		int W = img.cols;
-		int H = img.rows;
-		int half_H = H / 2;
-		int half_W = W / 2;
+		sp.W = img.cols;
+		sp.H = img.rows;
+		sp.half_H = sp.H / 2;
+		sp.half_W = sp.W / 2;
 
-		int shift_w = half_W / shift_w_ratio;
-		int shift_h = half_H / shift_h_ratio;
-		int window_width = half_W / window_windth_raio;
-		int grad_threshold = grad_threshold_ratio * window_width;
-		int minX_threshold = half_W / minX_threshold_ratio;
-
-		int x_l, x_h, y_l, y_h;
-
-		int channel_step = img.type() == CV_8UC3 ? 3 : 1;
-
-		int c_half_W = channel_step * half_W;
+		sp.shift_w = EdgeShift(sp.W);
+		sp.shift_h = sp.half_H / shift_h_ratio;
+		sp.window_width = sp.half_W / window_windth_raio;
+		sp.grad_threshold = grad_threshold_ratio * sp.window_width;
+		sp.minX_threshold = sp.half_W / minX_threshold_ratio;
 
 		//ôֵҵ߽,ı߽
 		{
-			//the coefficient that convert the bgr to grey value
-			double coeffs[3] = { 0.114f, 0.587f, 0.299f };
+			auto grayAt = [&](int y, int x)
+			{
+				const uchar *p = img.ptr(y);
+				return img.channels() == 1 ? int(p[x]) : GrayRow::GrayPixel(p + x * 3);
+			};
 
 			//õСXminX maxX
-			int minX = -1, maxX = W;
-			const uchar * median_row_ptr = img.ptr(half_H);
-			int temp_value;
-
-			for (int i = 0; i < c_half_W; i += channel_step)
+			int minX = -1, maxX = sp.W;
+			GrayRow median_row;
+			median_row.attach(img, sp.half_H);
+			for (int i = 0; i < sp.half_W; i++)
 			{
-				if (channel_step == 1)
-				{
-					temp_value = median_row_ptr[i];
-				}
-				else temp_value = coeffs[0] * median_row_ptr[i] + coeffs[1] * median_row_ptr[i + 1] + coeffs[2] * median_row_ptr[i + 2];
-				if (temp_value <= edge_black)
+				if (median_row.at(i) <= sp.edge_black)
 					minX++;
 				else break;
 			}
-			for (int i = channel_step * (img.cols - 1); i >= c_half_W; i -= channel_step)
+			for (int i = sp.W - 1; i >= sp.half_W; i--)
 			{
-				if (channel_step == 1)
-				{
-					temp_value = median_row_ptr[i];
-				}
-				else temp_value = coeffs[0] * median_row_ptr[i] + coeffs[1] * median_row_ptr[i + 1] + coeffs[2] * median_row_ptr[i + 2];
-				if (temp_value <= edge_black)
+				if (median_row.at(i) <= sp.edge_black)
 					maxX--;
 				else break;
 			}
 
 			//õСYminY maxY
-			int minY = -1, maxY = img.rows;
-			for (size_t i = 0; i < half_H; i++)
+			int minY = -1, maxY = sp.H;
+			for (int i = 0; i < sp.half_H; i++)
 			{
-				const uchar * row_ptr = img.ptr(i);
-				if (channel_step == 1)
-				{
-					temp_value = row_ptr[c_half_W];
-				}
-				else temp_value = coeffs[0] * row_ptr[c_half_W] + coeffs[1] * row_ptr[c_half_W + 1] + coeffs[2] * row_ptr[c_half_W + 2];
-				if (temp_value <= edge_black)
+				if (grayAt(i, sp.half_W) <= sp.edge_black)
 					minY++;
 			}
-			for (size_t i = img.rows - 1; i > half_H; i--)
+			for (int i = sp.H - 1; i > sp.half_H; i--)
 			{
-				const uchar * row_ptr = img.ptr(i);
-				if (channel_step == 1)
-				{
-					temp_value = row_ptr[c_half_W];
-				}
-				else temp_value = coeffs[0] * row_ptr[c_half_W] + coeffs[1] * row_ptr[c_half_W + 1] + coeffs[2] * row_ptr[c_half_W + 2];
-				if (temp_value <= edge_black)
+				if (grayAt(i, sp.half_W) <= sp.edge_black)
 					maxY--;
 			}
 
-			x_l = minX == -1 ? 0 : minX;
-			x_h = maxX == img.cols ? img.cols - 1 : maxX;
-			y_l = minY == -1 ? 0 : minY;
-			y_h = maxY == img.rows ? img.rows - 1 : maxY;
+			sp.x_l = minX == -1 ? 0 : minX;
+			sp.x_h = maxX == sp.W ? sp.W - 1 : maxX;
+			sp.y_l = minY == -1 ? 0 : minY;
+			sp.y_h = maxY == sp.H ? sp.H - 1 : maxY;
+
+			sp.y_l += sp.shift_h;
+			sp.y_h -= sp.shift_h;
+
+			assert(sp.x_l < sp.half_W && sp.x_h > sp.half_W && sp.y_l < sp.half_H && sp.y_h > sp.half_H);
+		}
+	}
+
+	//the points are appended to circle_points after clearing it, the capacity of the buffers
+	//is kept between the frames
+	void _getCircleEdgePoints(const cv::Mat &img, std::vector<cv::Point2i> &circle_points)
+	{
+		circle_points.clear();
+		assert(img.type() == CV_8UC3 || img.type() == CV_8UC1);
+
+		ScanParams sp;
+		_getScanParams(img, sp);
 
-			y_l += shift_h;
-			y_h -= shift_h;
+		int stripeNum = mbParallel ? int(SCAN_STRIPE_NUM) : 1;
+		if (int(mvStripe.size()) < stripeNum) mvStripe.resize(stripeNum);
+		size_t integralLength = size_t(sp.half_W + sp.window_width + 1);
+		for (int s = 0; s < stripeNum; s++)
+		{
+			if (mvStripe[s].row_integral.size() < integralLength) mvStripe[s].row_integral.resize(integralLength);
+		}
+
+		if (mbParallel)
+		{
+			_scanRowsParallel(img, sp, circle_points);
+			return;
+		}
+
+		GrayRow &gray = mvStripe[0].gray;
+		std::vector<int> &row_integral = mvStripe[0].row_integral;
+		RowEdges edges;
+
+		//°ͼв
+		for (int j = sp.half_H; j < sp.y_h; j += sp.step)
+		{
+			_scanRow(img, j, sp, gray, row_integral, edges);
+			_addEdges(edges, j, circle_points);
+			if (edges.dark)
+				break;
+		}
 
-			assert(x_l < half_W && x_h > half_W && y_l < half_H && y_h > half_H);
+		//ϰͼв
+		for (int j = sp.half_H; j > sp.y_l; j -= sp.step)
+		{
+			_scanRow(img, j, sp, gray, row_integral, edges);
+			_addEdges(edges, j, circle_points);
+			if (edges.dark)
+				break;
 		}
+	}
+
+	//the rows of the two halves are scanned independently into their own slots, then they are
+	//merged in the serial order, each half stops at its first dark row like the serial scan.
+	//the rows after a dark row are scanned for nothing, they are rare since the vertical
+	//range is limited by the boundary box
+	void _scanRowsParallel(const cv::Mat &img, const ScanParams &sp, std::vector<cv::Point2i> &circle_points)
+	{
+		std::vector<int> &vRow = mvRow;
+		vRow.clear();
+		for (int j = sp.half_H; j < sp.y_h; j += sp.step) vRow.push_back(j);
+		int lowerNum = int(vRow.size());
+		for (int j = sp.half_H; j > sp.y_l; j -= sp.step) vRow.push_back(j);
+		int rowNum = int(vRow.size());
 
-		std::vector<int> row_integral(half_W + window_width + 1, 0);
+		std::vector<RowEdges> &vEdges = mvEdges;
+		vEdges.resize(rowNum);
+		int stripeNum = std::max(1, std::min(int(SCAN_STRIPE_NUM), rowNum));
 
+		cv::parallel_for_(cv::Range(0, stripeNum), RowScanner(this, img, sp, vRow, stripeNum, mvStripe, vEdges));
+
+		for (int i = 0; i < lowerNum; i++)
+		{
+			_addEdges(vEdges[i], vRow[i], circle_points);
+			if (vEdges[i].dark) break;
+		}
+		for (int i = lowerNum; i < rowNum; i++)
 		{
-			double coeffs[3] = { 0.114f, 0.587f, 0.299f };
-			assert(img.type() == CV_8UC3 || img.type() == CV_8UC1);
+			_addEdges(vEdges[i], vRow[i], circle_points);
+			if (vEdges[i].dark) break;
+		}
+	}
 
+	//every stripe scans a contiguous range of the rows with its own scratch
+	class RowScanner : public cv::ParallelLoopBody
+	{
+	public:
+		RowScanner(const RasterScanDetector *pDetector, const cv::Mat &img, const ScanParams &sp,
+				   const std::vector<int> &vRow, int stripeNum, std::vector<ScanStripe> &vStripe, std::vector<RowEdges> &vEdges) :
+			mpDetector(pDetector), mImg(img), mSp(sp), mvRow(vRow), mStripeNum(stripeNum), mvStripe(vStripe), mvEdges(vEdges) {}
 
-			//°ͼв
-			for (int j = half_H; j < y_h; j += step)
+		virtual void operator()(const cv::Range &range) const
+		{
+			int rowNum = int(mvRow.size()), stripeNum = mStripeNum;
+			for (int s = range.start; s < range.end; s++)
 			{
-				const uchar * down_row_ptr = img.ptr(j);
-
-				//ͼв
-				int max_length = 0;
-				int minX1 = 0;
-				row_integral[0] = 0;
-				bool mini_clock = false;
-				int temp_value;
-				for (int i = x_l * channel_step; i < c_half_W; i += channel_step, max_length++)
-				{
-					if (channel_step == 1)
-					{
-						temp_value = down_row_ptr[i];
-					}
-					else temp_value = coeffs[0] * down_row_ptr[i] + coeffs[1] * down_row_ptr[i + 1] + coeffs[2] * down_row_ptr[i + 2];
-
-					row_integral[max_length + 1] = row_integral[max_length] + temp_value;
-					if (temp_value <= m_black && !mini_clock)minX1++;
-					if (temp_value > m_black)mini_clock = true;
-					if (temp_value >= big_black)
-					{
-						max_length++;
-						break;
-					}
-				}
-				if (max_length != 1 && minX1 != half_W - x_l && minX1 > minX_threshold)
+				ScanStripe &stripe = mvStripe[s];
+				int end = int(int64(rowNum) * (s + 1) / stripeNum);
+				for (int i = int(int64(rowNum) * s / stripeNum); i < end; i++)
 				{
-					int start = max_length + x_l;
-					int end = start + window_width;
-					start *= channel_step;
-					end *= channel_step;
-					int max_length_temp = max_length;
-					for (int i = start; i < end; i += channel_step, max_length_temp++)
-					{
-						if (channel_step == 1)
-						{
-							temp_value = down_row_ptr[i];
-						}
-						else temp_value = coeffs[0] * down_row_ptr[i] + coeffs[1] * down_row_ptr[i + 1] + coeffs[2] * down_row_ptr[i + 2];
-
-						row_integral[max_length_temp + 1] = row_integral[max_length_temp] + temp_value;
-					}
-
-					int max_diff = 0;
-					int max_index = minX1;
-					for (int i = minX1; i <= max_length; i++)
-					{
-						int left_value, right_value;
-						if (i > window_width)
-						{
-							left_value = row_integral[i] - row_integral[i - window_width];
-						}
-						else left_value = row_integral[i];
-
-						right_value = row_integral[i + window_width] - row_integral[i];
-
-						double diff_temp = right_value - left_value;
-						if (diff_temp > max_diff)
-						{
-							max_diff = diff_temp;
-							max_index = i;
-						}
-						else if (max_diff > grad_threshold)break;
-					}
-
-					max_index += x_l;
-					if (max_index >= shift_w)
-					{
-						max_index -= shift_w;
-						std::vector<int> point(2);
-						point[0] = max_index;
-						point[1] = j;
-						circle_points.push_back(point);
-					}
+					mpDetector->_scanRow(mImg, mvRow[i], mSp, stripe.gray, stripe.row_integral, mvEdges[i]);
 				}
+			}
+		}
 
-				//Ұͼв
-				max_length = 0;
-				row_integral[0] = 0;
-				int minX2 = 0;
-				mini_clock = false;
-				for (int i = x_h * channel_step; i > c_half_W; i -= channel_step, max_length++)
-				{
-					if (channel_step == 1)
-					{
-						temp_value = down_row_ptr[i];
-					}
-					else temp_value = coeffs[0] * down_row_ptr[i] + coeffs[1] * down_row_ptr[i + 1] + coeffs[2] * down_row_ptr[i + 2];
-
-					row_integral[max_length + 1] = row_integral[max_length] + temp_value;
-					if (temp_value <= m_black && !mini_clock)minX2++;
-					if (temp_value > m_black)mini_clock = true;
-					if (temp_value >= big_black)
-					{
-						max_length++;
-						break;
-					}
-				}
-				if (max_length != 1 && minX2 != x_h - half_W && minX2 > minX_threshold)
-				{
-					int start = x_h - max_length;
-					int end = start - window_width;
-					start *= channel_step;
-					end *= channel_step;
-					int max_length_temp = max_length;
-					for (int i = start; i > end; i -= channel_step, max_length_temp++)
-					{
-						if (channel_step == 1)
-						{
-							temp_value = down_row_ptr[i];
-						}
-						else temp_value = coeffs[0] * down_row_ptr[i] + coeffs[1] * down_row_ptr[i + 1] + coeffs[2] * down_row_ptr[i + 2];
-						row_integral[max_length_temp + 1] = row_integral[max_length_temp] + temp_value;
-					}
-
-					int max_diff = 0;
-					int max_index = minX2;
-					for (int i = minX2; i <= max_length; i++)
-					{
-						int left_value, right_value;
-						if (i > window_width)
-						{
-							left_value = row_integral[i] - row_integral[i - window_width];
-						}
-						else left_value = row_integral[i];
-
-						right_value = row_integral[i + window_width] - row_integral[i];
-
-						double diff_temp = right_value - left_value;
-						if (diff_temp > max_diff)
-						{
-							max_diff = diff_temp;
-							max_index = i;
-						}
-						else if (max_diff > grad_threshold)break;
-					}
-
-					max_index = x_h - max_index;
-					if (W - max_index > shift_w)
-					{
-						max_index += shift_w;
-						std::vector<int> point(2);
-						point[0] = max_index;
-						point[1] = j;
-						circle_points.push_back(point);
-					}
-				}
+	private:
+		const RasterScanDetector *mpDetector;
+		const cv::Mat &mImg;
+		const ScanParams &mSp;
+		const std::vector<int> &mvRow;
+		int mStripeNum;
+		std::vector<ScanStripe> &mvStripe;
+		std::vector<RowEdges> &mvEdges;
+	};
 
-				if (minX1 == half_W - x_l && minX2 == x_h - half_W)
-					break;
+	static void _addEdges(const RowEdges &edges, int j, std::vector<cv::Point2i> &circle_points)
+	{
+		for (int k = 0; k < 2; k++)
+		{
+			if (edges.found[k]) circle_points.push_back(cv::Point2i(edges.edge[k], j));
+		}
+	}
+
+	//scan the two sides of the row j
+	void _scanRow(const cv::Mat &img, int j, const ScanParams &sp, GrayRow &gray,
+				  std::vector<int> &row_integral, RowEdges &edges) const
+	{
+		gray.attach(img, j);
+		int minX1, minX2;
+
+		//ͼв
+		edges.found[0] = _scanSide(gray, sp, 1, row_integral, minX1, edges.edge[0]);
+
+		//Ұͼв
+		edges.found[1] = _scanSide(gray, sp, -1, row_integral, minX2, edges.edge[1]);
+
+		edges.dark = minX1 == sp.half_W - sp.x_l && minX2 == sp.x_h - sp.half_W;
+	}
+
+	//scan one side of the row from the boundary toward the center, dir is 1 from x_l and
+	//-1 from x_h, the prefix sums of the gray values are kept in row_integral.
+	//minX returns the length of the black run at the boundary, the edge is the max of the
+	//difference of the two neighbouring windows, returns false if there is no edge
+	bool _scanSide(GrayRow &gray, const ScanParams &sp, int dir, std::vector<int> &row_integral, int &minX, int &edge) const
+	{
+		int x0 = dir > 0 ? sp.x_l : sp.x_h;
+		int length = dir > 0 ? sp.half_W - sp.x_l : sp.x_h - sp.half_W;
+
+		int max_length = 0;
+		minX = 0;
+		row_integral[0] = 0;
+		bool mini_clock = false;
+		for (int x = x0; max_length < length; x += dir, max_length++)
+		{
+			int temp_value = gray.at(x);
+			row_integral[max_length + 1] = row_integral[max_length] + temp_value;
+			if (temp_value <= sp.m_black && !mini_clock)minX++;
+			if (temp_value > sp.m_black)mini_clock = true;
+			if (temp_value >= sp.big_black)
+			{
+				max_length++;
+				break;
 			}
+		}
+		if (max_length == 1 || minX == length || minX <= sp.minX_threshold)
+			return false;
+
+		//the window after the first bright pixel
+		int x = x0 + dir * max_length;
+		for (int i = max_length; i < max_length + sp.window_width; i++, x += dir)
+		{
+			row_integral[i + 1] = row_integral[i] + gray.at(x);
+		}
 
-			//ϰͼв
-			for (int j = half_H; j > y_l; j -= step)
+		int max_index = _maxWindowDiff(row_integral, minX, max_length, sp.window_width, sp.grad_threshold);
+
+		edge = x0 + dir * max_index - dir * sp.shift_w;
+		return edge >= 0 && edge < sp.W;
+	}
+
+	//the index in [begin, end] maximizing the difference of the sums of the windows after
+	//and before it, the search stops once the max is above grad_threshold and starts to drop
+	static int _maxWindowDiff(const std::vector<int> &row_integral, int begin, int end, int window_width, int grad_threshold)
+	{
+		int max_diff = 0;
+		int max_index = begin;
+		for (int i = begin; i <= end; i++)
+		{
+			int left_value, right_value;
+			if (i > window_width)
 			{
-				const uchar * up_row_ptr = img.ptr(j);
-
-				//ͼв
-				int max_length = 0;
-				int minX1 = 0;
-				row_integral[0] = 0;
-				int temp_value;
-				bool mini_clock = false;
-				for (int i = x_l * channel_step; i < c_half_W; i += channel_step, max_length++)
-				{
-					if (channel_step == 1)
-					{
-						temp_value = up_row_ptr[i];
-					}
-					else temp_value = coeffs[0] * up_row_ptr[i] + coeffs[1] * up_row_ptr[i + 1] + coeffs[2] * up_row_ptr[i + 2];
-					row_integral[max_length + 1] = row_integral[max_length] + temp_value;
-					if (temp_value <= m_black && !mini_clock)minX1++;
-					if (temp_value > m_black)mini_clock = true;
-					if (temp_value >= big_black)
-					{
-						max_length++;
-						break;
-					}
-				}
-				if (max_length != 1 && minX1 != half_W - x_l&& minX1 > minX_threshold)
-				{
-					int start = max_length + x_l;
-					int end = start + window_width;
-					start *= channel_step;
-					end *= channel_step;
-					int max_length_temp = max_length;
-					for (int i = start; i < end; i += channel_step, max_length_temp++)
-					{
-						if (channel_step == 1)
-						{
-							temp_value = up_row_ptr[i];
-						}
-						else temp_value = coeffs[0] * up_row_ptr[i] + coeffs[1] * up_row_ptr[i + 1] + coeffs[2] * up_row_ptr[i + 2];
-						row_integral[max_length_temp + 1] = row_integral[max_length_temp] + temp_value;
-					}
-
-					int max_diff = 0;
-					int max_index = minX1;
-					for (int i = minX1; i <= max_length; i++)
-					{
-						int left_value, right_value;
-						if (i > window_width)
-						{
-							left_value = row_integral[i] - row_integral[i - window_width];
-						}
-						else left_value = row_integral[i];
-
-						right_value = row_integral[i + window_width] - row_integral[i];
-
-						double diff_temp = right_value - left_value;
-						if (diff_temp > max_diff)
-						{
-							max_diff = diff_temp;
-							max_index = i;
-						}
-						else if (max_diff > grad_threshold)break;
-					}
-
-					max_index += x_l;
-					if (max_index >= shift_w)
-					{
-						max_index -= shift_w;
-						std::vector<int> point(2);
-						point[0] = max_index;
-						point[1] = j;
-						circle_points.push_back(point);
-					}
-				}
+				left_value = row_integral[i] - row_integral[i - window_width];
+			}
+			else left_value = row_integral[i];
+
+			right_value = row_integral[i + window_width] - row_integral[i];
+
+			int diff_temp = right_value - left_value;
+			if (diff_temp > max_diff)
+			{
+				max_diff = diff_temp;
+				max_index = i;
+			}
+			else if (max_diff > grad_threshold)break;
+		}
+		return max_index;
+	}
 
-				//Ұͼв
-				max_length = 0;
-				row_integral[0] = 0;
-				int minX2 = 0;
-				mini_clock = false;
-				for (int i = x_h * channel_step; i > c_half_W; i -= channel_step, max_length++)
+	bool mbParallel;
+	double mInlierRatio;
+
+	//the scratch kept between the frames, stripe 0 is also used by the serial scan
+	std::vector<ScanStripe> mvStripe;
+	std::vector<int> mvRow;
+	std::vector<RowEdges> mvEdges;
+	std::vector<cv::Point2i> mvEdgePoints;
+	std::vector<char> mvInlierMask;
+	CircleRansac mRansac;
+};
+
+
+
+
+//The circle tracking of the video frames. The edges are searched on the rays from the
+//previous center, in a narrow band around the previous radius, and fitted by CircleRansac.
+//The full RasterScanDetector runs on the first frame and whenever the tracked circle is not
+//confident, too few rays found an edge or too few of them fit the circle
+class CircleTracker : public CircleDetector
+{
+public:
+	CircleTracker(bool parallel = false) : mDetector(parallel), mbTracking(false), mRayNum(360), mBand(16),
+		mWindow(4), mGradRatio(20), mMinFoundRatio(0.5), mMinInlierRatio(0.8), mFallbackNum(0) {}
+	~CircleTracker() {}
+
+	//rayNum rays are cast, the edge is searched within band pixels of the previous radius
+	void setSearch(int rayNum, int band) { mRayNum = rayNum; mBand = band; }
+
+	//the tracked circle is accepted if minFoundRatio of the rays found an edge and
+	//minInlierRatio of the edges fit the circle
+	void setConfidence(double minFoundRatio, double minInlierRatio)
+	{
+		mMinFoundRatio = minFoundRatio;
+		mMinInlierRatio = minInlierRatio;
+	}
+
+	//the next frame runs the full detector
+	void reset() { mbTracking = false; }
+
+	//the frames that ran the full detector
+	int getFallbackNum() const { return mFallbackNum; }
+
+	virtual Circle detect(const cv::Mat &img)
+	{
+		assert(img.type() == CV_8UC3 || img.type() == CV_8UC1);
+		if (!mbTracking || !_track(img))
+		{
+			mCircle = mDetector.detect(img);
+			mbTracking = mDetector.getInlierRatio() >= mMinInlierRatio;
+			mFallbackNum++;
+		}
+		return mCircle;
+	}
+
+private:
+	bool _track(const cv::Mat &img)
+	{
+		//the rays search the gradient edge, the circle is mEdgeShift outside of it like RasterScanDetector
+		int edgeShift = RasterScanDetector::EdgeShift(img.cols);
+		double center = mCircle.radius - edgeShift;
+		int length = 2 * (mBand + mWindow) + 1;
+		if (center - mBand - mWindow < 1) return false;
+		if (int(mvIntegral.size()) < length + 1) mvIntegral.resize(length + 1);
+
+		mvPoints.clear();
+		int channels = img.channels();
+		for (int k = 0; k < mRayNum; k++)
+		{
+			double angle = CV_2PI * k / mRayNum;
+			double dx = cos(angle), dy = sin(angle);
+
+			//the prefix sums of the gray values on the ray from the inside to the outside
+			double t0 = center - mBand - mWindow;
+			bool inside = true;
+			mvIntegral[0] = 0;
+			for (int i = 0; i < length; i++)
+			{
+				int x = cvRound(mCircle.center.x + (t0 + i) * dx), y = cvRound(mCircle.center.y + (t0 + i) * dy);
+				if (x < 0 || y < 0 || x >= img.cols || y >= img.rows)
 				{
-					if (channel_step == 1)
-					{
-						temp_value = up_row_ptr[i];
-					}
-					else temp_value = coeffs[0] * up_row_ptr[i] + coeffs[1] * up_row_ptr[i + 1] + coeffs[2] * up_row_ptr[i + 2];
-					row_integral[max_length + 1] = row_integral[max_length] + temp_value;
-					if (temp_value <= m_black && !mini_clock)minX2++;
-					if (temp_value > m_black)mini_clock = true;
-					if (temp_value >= big_black)
-					{
-						max_length++;
-						break;
-					}
+					inside = false;
+					break;
 				}
-				if (max_length != 1 && minX2 != x_h - half_W && minX2 > minX_threshold)
+				const uchar *p = img.ptr(y) + x * channels;
+				mvIntegral[i + 1] = mvIntegral[i] + (channels == 1 ? int(p[0]) : GrayRow::GrayPixel(p));
+			}
+			if (!inside) continue;
+
+			//the bright inside and the dark outside, the same threshold per pixel as the raster scan
+			int max_diff = mGradRatio * mWindow, max_index = -1;
+			for (int i = mWindow; i + mWindow <= length; i++)
+			{
+				int diff = (mvIntegral[i] - mvIntegral[i - mWindow]) - (mvIntegral[i + mWindow] - mvIntegral[i]);
+				if (diff > max_diff)
 				{
-					int start = x_h - max_length;
-					int end = start - window_width;
-					start *= channel_step;
-					end *= channel_step;
-					int max_length_temp = max_length;
-					for (int i = start; i > end; i -= channel_step, max_length_temp++)
-					{
-						if (channel_step == 1)
-						{
-							temp_value = up_row_ptr[i];
-						}
-						else temp_value = coeffs[0] * up_row_ptr[i] + coeffs[1] * up_row_ptr[i + 1] + coeffs[2] * up_row_ptr[i + 2];
-						row_integral[max_length_temp + 1] = row_integral[max_length_temp] + temp_value;
-					}
-
-					int max_diff = 0;
-					int max_index = minX2;
-					for (int i = minX2; i <= max_length; i++)
-					{
-						int left_value, right_value;
-						if (i > window_width)
-						{
-							left_value = row_integral[i] - row_integral[i - window_width];
-						}
-						else left_value = row_integral[i];
-
-						right_value = row_integral[i + window_width] - row_integral[i];
-
-						double diff_temp = right_value - left_value;
-						if (diff_temp > max_diff)
-						{
-							max_diff = diff_temp;
-							max_index = i;
-						}
-						else if (max_diff > grad_threshold)break;
-					}
-
-					max_index = x_h - max_index;
-					if (W - max_index > shift_w)
-					{
-						max_index += shift_w;
-						std::vector<int> point(2);
-						point[0] = max_index;
-						point[1] = j;
-						circle_points.push_back(point);
-					}
+					max_diff = diff;
+					max_index = i;
 				}
-
-				if (minX1 == half_W - x_l && minX2 == x_h - half_W)
-					break;
 			}
+			if (max_index < 0) continue;
+
+			//the last bright sample, like the edge of the raster scan
+			double t = t0 + max_index - 1 + edgeShift;
+			mvPoints.push_back(cv::Point2i(cvRound(mCircle.center.x + t * dx), cvRound(mCircle.center.y + t * dy)));
 		}
+		if (mvPoints.size() < mMinFoundRatio * mRayNum) return false;
+
+		double inlierRatio = mRansac.run(mvPoints, mvInlierMask);
+		if (inlierRatio < mMinInlierRatio) return false;
+
+		double x, y, radius_s;
+		mRansac.getCircle(x, y, radius_s);
+		Circle circle = { cv::Point2d(x, y), sqrt(radius_s) };
+		//the circle can not move more than the band in one frame
+		if (fabs(circle.radius - mCircle.radius) > mBand || cv::norm(circle.center - mCircle.center) > mBand) return false;
+		mCircle = circle;
+		return true;
 	}
+
+	RasterScanDetector mDetector;
+	Circle mCircle;
+	bool mbTracking;
+	int mRayNum, mBand, mWindow, mGradRatio;
+	double mMinFoundRatio, mMinInlierRatio;
+	int mFallbackNum;
+
+	//the scratch kept between the frames
+	std::vector<int> mvIntegral;
+	std::vector<cv::Point2i> mvPoints;
+	std::vector<char> mvInlierMask;
+	CircleRansac mRansac;
 };
 
+std::string filename = "2S7A7011.jpg";
+std::string videoName = "";
+bool parallelScan = false;
+bool verbose = false;
 
+int parseCmdArgs(int argc, char** argv)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if ((arg == "-image" || arg == "-video") && i + 1 >= argc)
+		{
+			std::cout << "Missing the file name after " << arg << std::endl;
+			std::cout << "Usage: CircleDetection [-image file] [-video file] [-parallel] [-verbose]" << std::endl;
+			return -1;
+		}
+
+		if (arg == "-image")
+		{
+			filename = argv[i + 1];
+			i++;
+		}
+		else if (arg == "-video")
+		{
+			videoName = argv[i + 1];
+			i++;
+		}
+		else if (arg == "-parallel")
+		{
+			parallelScan = true;
+		}
+		else if (arg == "-verbose")
+		{
+			verbose = true;
+		}
+	}
+
+	return 0;
+}
 
+//track the circle over the frames of the video, the full detection only runs on the
+//first frame and when the tracking is lost. The circle of every frame is printed with
+//-verbose, otherwise only the summary
+int runVideo()
+{
+	cv::VideoCapture capture(videoName);
+	if (!capture.isOpened())
+	{
+		std::cout << "can not open the video " << videoName << std::endl;
+		return -1;
+	}
+
+	CircleTracker tracker(parallelScan);
+	cv::Mat frame;
+	int frameNum = 0;
+	double totalTime = 0;
+	while (capture.read(frame))
+	{
+		int64 start = cv::getTickCount();
+		CircleDetector::Circle circle = tracker.detect(frame);
+		totalTime += (cv::getTickCount() - start) / cv::getTickFrequency();
+		if (verbose)
+		{
+			std::cout << "frame " << frameNum << " : center (" << circle.center.x << ", " << circle.center.y
+				<< ") radius " << circle.radius << std::endl;
+		}
+		frameNum++;
+	}
+
+	std::cout << frameNum << " frames, " << tracker.getFallbackNum() << " full detections, "
+		<< (frameNum > 0 ? totalTime * 1000 / frameNum : 0) << " ms per frame" << std::endl;
+	return 0;
+}
 
 int main(int argc, char *argv[])
 {
-	std::string filename = "2S7A7011.jpg";
-	std::shared_ptr<CircleDetector> pCDetector = std::make_shared<RasterScanDetector>();
+	if (parseCmdArgs(argc, argv) != 0)
+	{
+		return -1;
+	}
+	if (!videoName.empty())
+	{
+		return runVideo();
+	}
 
+	std::shared_ptr<CircleDetector> pCDetector = std::make_shared<RasterScanDetector>(parallelScan);
 	cv::Mat img = cv::imread(filename);
 	CircleDetector::Circle circle;
 	IntevalTime(circle = pCDetector->detect(img));
@@ -0,0 +1,197 @@
+#define MAIN_FILE
+#include <commonMacro.h>
+#include "../common/OptimizeCommon.h"
+#include <iostream>
+#include <chrono>
+#include <limits>
+#include "../common/CameraModel.h"
+#include "../common/RandomStream.h"
+
+//the heap allocating solver replaced by FishEye::solveQuadratic, kept as the baseline
+inline std::vector<double> solverUnitaryQuadraticVector(const double &a, const double &b, const double &c)
+{
+	std::vector<double> result;
+	result.reserve(2);
+	if (a == 0)
+	{
+		if (b != 0)
+		{
+			result.push_back(-c / b);
+		}
+	}
+	else
+	{
+		double delta = b*b - 4 * a*c;
+		if (delta >= 0)
+		{
+			if (delta > 0)
+			{
+				double sqrtDelta = sqrt(delta);
+				result.push_back((-b + sqrtDelta) / (2 * a));
+				result.push_back((-b - sqrtDelta) / (2 * a));
+			}
+			else
+			{
+				result.push_back(-b * 0.5 / a);
+			}
+		}
+	}
+	return result;
+}
+
+//run func(i) for i in [0, num) and return the nanoseconds per call
+template<class Func>
+double MeasurePerCall(int num, int repeat, Func func)
+{
+	double best = std::numeric_limits<double>::max();
+	for (int r = 0; r < repeat; r++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < num; i++)
+		{
+			func(i);
+		}
+		auto end = std::chrono::steady_clock::now();
+		best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count() / num);
+	}
+	return best;
+}
+
+//the largest difference between the analytic and the central difference Jacobian of
+//the refinement of typeName, over a few synthetic trials and parameter points around
+//the start of RefineGeneralModel. Return -1 if an evaluation fails
+double MaxJacobianDifference(const std::string &typeName, const cv::Vec2d &args)
+{
+	SyntheticDataConfig config;
+	config.pairNum = 100;
+	config.sigma = 1;
+	config.seed = 2018;
+	SyntheticDataFactory factory(config);
+	FishEye::Equidistant baseModel(0, 0, 1, CV_PI);
+
+	const int trialNum = 3, pointNum = 3;
+	double maxDiff = 0;
+	for (int t = 0; t < trialNum; t++)
+	{
+		std::shared_ptr<ModelDataProducer> pModelData = factory.produce(t);
+		double maxRadius = pModelData->mpCam->maxRadius;
+		std::shared_ptr<CameraModel> pModel = createCameraModel(typeName, 0, 0, maxRadius / baseModel.maxRadius,
+																CV_PI, maxRadius, args[0], args[1]);
+		std::shared_ptr<const PairImagePoints> pImgPts = std::make_shared<const PairImagePoints>(*pModelData);
+		std::shared_ptr<Rotation> pRot = std::make_shared<Rotation>(cv::Vec3d(0, 0, 1), CV_PI*0.5);
+		CalculateRotation(*pImgPts, pModel, pRot);
+
+		std::vector<uchar> vMask(pModel->vpParameter.size(), 1);
+		vMask[0] = vMask[1] = 0;
+		FishModelRefineCallback cb(pModelData, pModel, pRot, vMask, pImgPts);
+
+		//param = {f, model coefficients, axisAngle}, the points move away from the start
+		int intrinsicNum = int(pModel->vpParameter.size()) - 2;
+		cv::Mat param0(intrinsicNum + 3, 1, CV_64FC1), param;
+		for (int i = 0; i < intrinsicNum; i++)
+			param0.at<double>(i, 0) = *(pModel->vpParameter[i + 2]);
+		for (int i = 0; i < 3; i++)
+			param0.at<double>(intrinsicNum + i, 0) = pRot->axisAngle[i];
+
+		for (int k = 0; k < pointNum; k++)
+		{
+			param0.copyTo(param);
+			for (int i = 0; i < intrinsicNum; i++)
+				param.at<double>(i, 0) *= 1 + 0.02 * k;
+			for (int i = 0; i < 3; i++)
+				param.at<double>(intrinsicNum + i, 0) += 0.01 * k;
+
+			double diff = cb.verifyJacobian(param);
+			if (diff < 0) return -1;
+			maxDiff = std::max(maxDiff, diff);
+		}
+	}
+	return maxDiff;
+}
+
+int main(int argc, char *argv[])
+{
+	const int num = 1000000, repeat = 5;
+	RandomStream rng(2018);
+
+	//the coefficients of the equations met by the two models
+	std::vector<double> vA(num), vB(num), vC(num);
+	for (int i = 0; i < num; i++)
+	{
+		vA[i] = rng.uniform(-1, 1);
+		vB[i] = rng.uniform(-2, 2);
+		vC[i] = rng.uniform(-1, 1);
+	}
+
+	double sink = 0;
+	double vectorTime = MeasurePerCall(num, repeat, [&](int i)
+	{
+		std::vector<double> root = solverUnitaryQuadraticVector(vA[i], vB[i], vC[i]);
+		for (size_t k = 0; k < root.size(); k++) sink += root[k];
+	});
+	double stackTime = MeasurePerCall(num, repeat, [&](int i)
+	{
+		FishEye::QuadraticRoots root = FishEye::solveQuadratic(vA[i], vB[i], vC[i]);
+		for (int k = 0; k < root.size(); k++) sink += root[k];
+	});
+
+	std::cout << "quadratic solver (ns per call)" << std::endl;
+	std::cout << "  std::vector roots : " << vectorTime << std::endl;
+	std::cout << "  QuadraticRoots    : " << stackTime << std::endl;
+
+	//the cancellation of the small root, x^2 + 1e8*x + 1 = 0 has the root about -1e-8
+	std::vector<double> naive = solverUnitaryQuadraticVector(1, 1e8, 1);
+	FishEye::QuadraticRoots stable = FishEye::solveQuadratic(1, 1e8, 1);
+	std::cout.precision(17);
+	std::cout << "small root of x^2 + 1e8*x + 1 : naive " << naive[0] << ", stable " << stable[0] << std::endl;
+	std::cout.precision(6);
+
+	//the per point cost of the models calling the solver
+	std::vector<double> vRadius(num), vAngle(num);
+	for (int i = 0; i < num; i++)
+	{
+		vRadius[i] = rng.uniform(0, 1.5);
+		vAngle[i] = rng.uniform(0, CV_PI * 0.5);
+	}
+
+	FishEye::PolynomialRadius polyRadius(0, 0, 300, 500, 1.038552, -0.407288);
+	FishEye::GeyerModel geyer(0, 0, 300, 500, 0.976517, 1.743803);
+	double polyRadiusTime = MeasurePerCall(num, repeat, [&](int i)
+	{
+		double radius;
+		if (polyRadius.project(vAngle[i], radius)) sink += radius;
+	});
+	double geyerTime = MeasurePerCall(num, repeat, [&](int i)
+	{
+		double angle;
+		if (geyer.inverseProject(vRadius[i], angle)) sink += angle;
+	});
+
+	std::cout << "per point (ns per call)" << std::endl;
+	std::cout << "  PolynomialRadius::project    : " << polyRadiusTime << std::endl;
+	std::cout << "  GeyerModel::inverseProject   : " << geyerTime << std::endl;
+	std::cout << "(checksum " << sink << ")" << std::endl;
+
+	//the analytic Jacobian of every model type against the central differences,
+	//the residuals are on the unit sphere so the tolerance is absolute
+	const double jacobianTolerance = 1e-5;
+	std::map<std::string, cv::Vec2d> modelInfo;
+	modelInfo["Equidistant"] = cv::Vec2d(1.0, 0.0);
+	modelInfo["Equisolid"] = cv::Vec2d(1.0, 0.0);
+	modelInfo["Stereographic"] = cv::Vec2d(1.0, 0.0);
+	modelInfo["PolynomialAngle"] = cv::Vec2d(1.000000, 0.000000);
+	modelInfo["PolynomialRadius"] = cv::Vec2d(1.038552, -0.407288);
+	modelInfo["GeyerModel"] = cv::Vec2d(0.976517, 1.743803);
+
+	int failedNum = 0;
+	std::cout << "jacobian check (max |analytic - numeric|)" << std::endl;
+	for (auto it = modelInfo.begin(); it != modelInfo.end(); ++it)
+	{
+		double diff = MaxJacobianDifference(it->first, it->second);
+		bool passed = diff >= 0 && diff <= jacobianTolerance;
+		if (!passed) failedNum++;
+		std::cout << "  " << it->first << " : " << diff << (passed ? "" : "  FAILED") << std::endl;
+	}
+
+	return failedNum == 0 ? 0 : 1;
+}
@@ -1,6 +1,52 @@
 #pragma once
 #include <OpencvCommon.h>
 
+//The structure-of-arrays buffer of image points used by the batch mapping,
+//x[i] and y[i] are the coordinates of the ith point
+struct ImagePointArray
+{
+	void resize(size_t num)
+	{
+		x.resize(num);
+		y.resize(num);
+	}
+
+	size_t size() const { return x.size(); }
+
+	void assign(const std::vector<cv::Point2d> &vPts)
+	{
+		resize(vPts.size());
+		for (size_t i = 0; i < vPts.size(); i++)
+		{
+			x[i] = vPts[i].x;
+			y[i] = vPts[i].y;
+		}
+	}
+
+	std::vector<double> x, y;
+};
+
+//The structure-of-arrays buffer of unit sphere points used by the batch mapping,
+//mask[i] is 0 when the mapping of the ith point is invalid,
+//jac is only filled by the mapping with derivatives and is arranged as
+//jac[(p * 3 + c) * size() + i] = d(component c of point i) / d(*vpParameter[p])
+struct SpherePointArray
+{
+	void resize(size_t num)
+	{
+		x.resize(num);
+		y.resize(num);
+		z.resize(num);
+		mask.resize(num);
+	}
+
+	size_t size() const { return x.size(); }
+
+	std::vector<double> x, y, z;
+	std::vector<uchar> mask;
+	std::vector<double> jac;
+};
+
 class CameraModel
 {
 public:
@@ -25,43 +71,137 @@ public:
 		fov = tmpAngle * 2;
 	}
 
-	//mapping the image coordinate to the unit sphere coordinate	
-	virtual bool mapI2S(const cv::Point2d &imgPt, cv::Point3d &spherePt)
+	//Enable the radius -> angle table used by the image to sphere mapping in place of
+	//inverseProject. The table is a cubic Hermite interpolation of the angle and
+	//d(angle)/d(radius) on cellNum cells over [0, maxRadius / f], and every cell whose error
+	//at the midpoint is larger than tolerance (or whose ends are invalid) uses the exact
+	//inverseProject, as well as the radius out of the table. The table is rebuilt by
+	//updateCache(), which must be called after changing the parameters. The building costs
+	//about 2 * cellNum exact solves, so it pays off for the dense mapping only
+	void setInverseTable(bool enable, int cellNum = 1024, double tolerance = 1e-10)
 	{
-		double x = (imgPt.x - u0) / f;
-		double y = (-imgPt.y + v0) / f;
-		double r_dist = sqrt(x*x + y*y);
+		assert(cellNum > 0 && tolerance > 0);
+		mInverseTable.enabled = enable;
+		mInverseTable.cellNum = cellNum;
+		mInverseTable.tolerance = tolerance;
+		updateCache();
+	}
 
-		double theta, phi;
-		theta = atan2(y, x);
+	bool isInverseTableEnabled() const { return mInverseTable.enabled; }
 
-		if (!inverseProject(r_dist, phi))
+	//rebuild the cached data depending on the parameters, it is not thread safe
+	//and must not be called while the model is being used by the batch mapping
+	void updateCache()
+	{
+		InverseProjectTable &table = mInverseTable;
+		table.range = 0;
+		if (!table.enabled || !(maxRadius > 0) || !(f > 0))
+			return;
+
+		int cellNum = table.cellNum;
+		double range = maxRadius / f;
+		table.step = range / cellNum;
+		table.invStep = cellNum / range;
+		table.angle.resize(cellNum + 1);
+		table.slope.resize(cellNum + 1);
+		table.cellValid.assign(cellNum, 0);
+
+		std::vector<uchar> vNodeValid(cellNum + 1);
+		std::vector<double> dAngle(vpParameter.size());
+		for (int k = 0; k <= cellNum; k++)
 		{
-			std::cout << "Warning: Invalid mapping in mapI2S" << std::endl;
-			return false;
+			vNodeValid[k] = inverseProjectDeriv(k * table.step, table.angle[k], dAngle.data()) ? 1 : 0;
+			table.slope[k] = dAngle[0];
 		}
 
-		spherePt.x = sin(phi)*cos(theta);
-		spherePt.y = sin(phi)*sin(theta);
-		spherePt.z = cos(phi);
-		return true;
+		for (int k = 0; k < cellNum; k++)
+		{
+			if (!vNodeValid[k] || !vNodeValid[k + 1])
+				continue;
+
+			double exact, approx;
+			if (!inverseProject((k + 0.5) * table.step, exact))
+				continue;
+			_interpolateInverseTable(k, 0.5, approx);
+			table.cellValid[k] = std::abs(exact - approx) <= table.tolerance ? 1 : 0;
+		}
+		table.range = range;
+	}
+
+	//mapping the image coordinate to the unit sphere coordinate	
+	virtual bool mapI2S(const cv::Point2d &imgPt, cv::Point3d &spherePt)
+	{
+		return _mapI2S(imgPt, spherePt,
+			[this](const double &radius, double &angle) { return _lookupInverseTable(radius, angle) || inverseProject(radius, angle); });
 	}
 
 	//mapping the unit sphere coordinate to the image coordinate	
 	virtual bool mapS2I(const cv::Point3d &spherePt, cv::Point2d &imgPt)
 	{
-		double theta, phi, r_dist;
-		theta = atan2(spherePt.y, spherePt.x);
-		phi = atan2(sqrt(spherePt.x*spherePt.x + spherePt.y*spherePt.y), spherePt.z);
-		if (phi * 2 > fov || !project(phi, r_dist))
-		{
-			std::cout << "Warning: Invalid mapping in mapS2I" << std::endl;
-			return false;
-		}
+		return _mapS2I(spherePt, imgPt,
+			[this](const double &angle, double &radius) { return project(angle, radius); });
+	}
 
-		imgPt.x = r_dist*cos(theta)*f + u0;
-		imgPt.y = -r_dist*sin(theta)*f + v0;
-		return true;
+	//mapping a batch of image coordinates to the unit sphere coordinates
+	//the points are stored as structure-of-arrays {x, y} -> {X, Y, Z},
+	//mask[i] is set to 0 if the ith mapping is invalid,
+	//return true only if all the points are mapped successfully
+	virtual bool mapI2SBatch(const double *x, const double *y, int num,
+							 double *X, double *Y, double *Z, uchar *mask)
+	{
+		return _mapI2SBatch(x, y, num, X, Y, Z, mask,
+			[this](const double &radius, double &angle) { return _lookupInverseTable(radius, angle) || inverseProject(radius, angle); });
+	}
+
+	//mapping a batch of unit sphere coordinates to the image coordinates
+	//the points are stored as structure-of-arrays {X, Y, Z} -> {x, y},
+	//mask[i] is set to 0 if the ith mapping is invalid,
+	//return true only if all the points are mapped successfully
+	virtual bool mapS2IBatch(const double *X, const double *Y, const double *Z, int num,
+							 double *x, double *y, uchar *mask)
+	{
+		return _mapS2IBatch(X, Y, Z, num, x, y, mask,
+			[this](const double &angle, double &radius) { return project(angle, radius); });
+	}
+
+	//the same as mapI2SBatch, and additionally output the derivatives of the
+	//sphere points with respect to all the parameters in vpParameter,
+	//jac[(p * 3 + c) * num + i] = d(component c of point i) / d(*vpParameter[p])
+	virtual bool mapI2SBatchDeriv(const double *x, const double *y, int num,
+								  double *X, double *Y, double *Z, uchar *mask, double *jac)
+	{
+		return _mapI2SBatchDeriv(x, y, num, X, Y, Z, mask, jac,
+			[this](const double &radius, double &angle, double *dAngle) { return inverseProjectDeriv(radius, angle, dAngle); });
+	}
+
+	bool mapI2S(const ImagePointArray &imgPts, SpherePointArray &spherePts)
+	{
+		int num = int(imgPts.size());
+		spherePts.resize(num);
+		if (num == 0) return true;
+		return mapI2SBatch(imgPts.x.data(), imgPts.y.data(), num,
+						   spherePts.x.data(), spherePts.y.data(), spherePts.z.data(), spherePts.mask.data());
+	}
+
+	bool mapI2SWithDeriv(const ImagePointArray &imgPts, SpherePointArray &spherePts)
+	{
+		int num = int(imgPts.size());
+		spherePts.resize(num);
+		spherePts.jac.resize(vpParameter.size() * 3 * num);
+		if (num == 0) return true;
+		return mapI2SBatchDeriv(imgPts.x.data(), imgPts.y.data(), num,
+								spherePts.x.data(), spherePts.y.data(), spherePts.z.data(),
+								spherePts.mask.data(), spherePts.jac.data());
+	}
+
+	bool mapS2I(const SpherePointArray &spherePts, ImagePointArray &imgPts, std::vector<uchar> &mask)
+	{
+		int num = int(spherePts.size());
+		imgPts.resize(num);
+		mask.resize(num);
+		if (num == 0) return true;
+		return mapS2IBatch(spherePts.x.data(), spherePts.y.data(), spherePts.z.data(), num,
+						   imgPts.x.data(), imgPts.y.data(), mask.data());
 	}
 
 	//projecting the imaging radius to the incident angle
@@ -87,6 +227,18 @@ public:
 		return true;
 	}
 
+	//projecting the imaging radius to the incident angle with the derivatives,
+	//dAngle[0] = d(angle)/d(radius), dAngle[1 + i] = d(angle)/d(*vpParameter[3 + i])
+	virtual bool inverseProjectDeriv(const double& radius, double &angle, double *dAngle)
+	{
+		if (!inverseProject(radius, angle))
+		{
+			return false;
+		}
+		dAngle[0] = 1.0 / (1.0 + radius * radius);
+		return true;
+	}
+
 	virtual std::string getTypeName()
 	{
 		return "Default";
@@ -100,51 +252,347 @@ public:
 	//which can be extended in the derive class
 	std::vector<double*> vpParameter;
 
+protected:
+	struct InverseProjectTable
+	{
+		InverseProjectTable() : enabled(false), cellNum(1024), tolerance(1e-10),
+			range(0), step(0), invStep(0) {}
+
+		bool enabled;
+		int cellNum;
+		double tolerance;
+		//range is 0 when the table is not built
+		double range, step, invStep;
+		std::vector<double> angle, slope;
+		std::vector<uchar> cellValid;
+	};
+
+	void _interpolateInverseTable(int k, double t, double &angle) const
+	{
+		const InverseProjectTable &table = mInverseTable;
+		double t2 = t * t, t3 = t2 * t;
+		double h00 = 2 * t3 - 3 * t2 + 1, h10 = t3 - 2 * t2 + t;
+		double h01 = -2 * t3 + 3 * t2, h11 = t3 - t2;
+		angle = h00 * table.angle[k] + h10 * table.step * table.slope[k] +
+			h01 * table.angle[k + 1] + h11 * table.step * table.slope[k + 1];
+	}
+
+	//return false if the radius is not covered by the table
+	bool _lookupInverseTable(const double &radius, double &angle) const
+	{
+		const InverseProjectTable &table = mInverseTable;
+		if (!(radius >= 0 && radius < table.range))
+			return false;
+
+		double u = radius * table.invStep;
+		int k = std::min(int(u), table.cellNum - 1);
+		if (!table.cellValid[k])
+			return false;
+
+		_interpolateInverseTable(k, u - k, angle);
+		return true;
+	}
+
+	InverseProjectTable mInverseTable;
+
+	//The single point kernels shared by all the models, the derived class passes its own
+	//projecting function, see the batch kernels below
+	template<class InverseProjector>
+	bool _mapI2S(const cv::Point2d &imgPt, cv::Point3d &spherePt, InverseProjector inverseProjector)
+	{
+		double x = (imgPt.x - u0) / f;
+		double y = (-imgPt.y + v0) / f;
+		double r_dist = sqrt(x*x + y*y);
+
+		double theta, phi;
+		theta = atan2(y, x);
+
+		if (!inverseProjector(r_dist, phi))
+		{
+			std::cout << "Warning: Invalid mapping in mapI2S" << std::endl;
+			return false;
+		}
+
+		spherePt.x = sin(phi)*cos(theta);
+		spherePt.y = sin(phi)*sin(theta);
+		spherePt.z = cos(phi);
+		return true;
+	}
+
+	template<class Projector>
+	bool _mapS2I(const cv::Point3d &spherePt, cv::Point2d &imgPt, Projector projector)
+	{
+		double theta, phi, r_dist;
+		theta = atan2(spherePt.y, spherePt.x);
+		phi = atan2(sqrt(spherePt.x*spherePt.x + spherePt.y*spherePt.y), spherePt.z);
+		if (phi * 2 > fov || !projector(phi, r_dist))
+		{
+			std::cout << "Warning: Invalid mapping in mapS2I" << std::endl;
+			return false;
+		}
+
+		imgPt.x = r_dist*cos(theta)*f + u0;
+		imgPt.y = -r_dist*sin(theta)*f + v0;
+		return true;
+	}
+
+	//The batch kernels shared by all the models, the derived class passes its own
+	//projecting function qualified by the class name, so there is no virtual call
+	//in the loop and the compiler is free to inline and vectorize it
+	template<class InverseProjector>
+	bool _mapI2SBatch(const double *x, const double *y, int num,
+					  double *X, double *Y, double *Z, uchar *mask, InverseProjector inverseProjector)
+	{
+		const double invF = 1.0 / f;
+		int validNum = 0;
+		for (int i = 0; i < num; i++)
+		{
+			double xn = (x[i] - u0) * invF;
+			double yn = (-y[i] + v0) * invF;
+			double r_dist = sqrt(xn*xn + yn*yn);
+			double phi = 0;
+			bool valid = inverseProjector(r_dist, phi);
+
+			//sin(phi)*cos(theta) = sin(phi) * xn / r_dist, the same for y
+			double scale = r_dist > 0 ? sin(phi) / r_dist : 0;
+			X[i] = scale * xn;
+			Y[i] = scale * yn;
+			Z[i] = cos(phi);
+			mask[i] = valid ? 1 : 0;
+			validNum += valid ? 1 : 0;
+		}
+		return validNum == num;
+	}
+
+	template<class InverseProjectorDeriv>
+	bool _mapI2SBatchDeriv(const double *x, const double *y, int num,
+						   double *X, double *Y, double *Z, uchar *mask, double *jac,
+						   InverseProjectorDeriv inverseProjectorDeriv)
+	{
+		const int paramNum = int(vpParameter.size());
+		const int extraNum = paramNum - 3;
+		const double invF = 1.0 / f;
+		double dAngle[8];
+		assert(extraNum + 1 <= 8);
+
+		int validNum = 0;
+		for (int i = 0; i < num; i++)
+		{
+			double xn = (x[i] - u0) * invF;
+			double yn = (-y[i] + v0) * invF;
+			double r_dist = sqrt(xn*xn + yn*yn);
+			double phi = 0;
+			for (int k = 0; k <= extraNum; k++) dAngle[k] = 0;
+			bool valid = inverseProjectorDeriv(r_dist, phi, dAngle);
+
+			double sinPhi = sin(phi), cosPhi = cos(phi);
+			double dPhi_dr = dAngle[0];
+
+			//rho = sin(phi) / r_dist, which tends to d(phi)/d(r) at the center
+			double rho, c, s;
+			if (r_dist > 0)
+			{
+				rho = sinPhi / r_dist;
+				c = xn / r_dist;
+				s = yn / r_dist;
+			}
+			else
+			{
+				rho = dPhi_dr;
+				c = 1;
+				s = 0;
+			}
+
+			X[i] = rho * xn;
+			Y[i] = rho * yn;
+			Z[i] = cosPhi;
+			mask[i] = valid ? 1 : 0;
+			validNum += valid ? 1 : 0;
+
+			//the derivative of the sphere point with respect to the incident angle
+			double dX_dPhi = cosPhi * c, dY_dPhi = cosPhi * s, dZ_dPhi = -sinPhi;
+
+			//the derivatives with respect to the normalized image coordinate (xn, yn)
+			double dX_dxn = dPhi_dr * dX_dPhi * c + rho * s * s;
+			double dY_dxn = dPhi_dr * dY_dPhi * c - rho * c * s;
+			double dZ_dxn = dPhi_dr * dZ_dPhi * c;
+			double dX_dyn = dPhi_dr * dX_dPhi * s - rho * c * s;
+			double dY_dyn = dPhi_dr * dY_dPhi * s + rho * c * c;
+			double dZ_dyn = dPhi_dr * dZ_dPhi * s;
+
+			double *J = jac + i;
+			//xn = (x - u0) / f
+			J[0 * num] = -dX_dxn * invF;
+			J[1 * num] = -dY_dxn * invF;
+			J[2 * num] = -dZ_dxn * invF;
+			//yn = (-y + v0) / f
+			J[3 * num] = dX_dyn * invF;
+			J[4 * num] = dY_dyn * invF;
+			J[5 * num] = dZ_dyn * invF;
+			//d(xn)/d(f) = -xn / f, d(yn)/d(f) = -yn / f
+			J[6 * num] = -(xn * dX_dxn + yn * dX_dyn) * invF;
+			J[7 * num] = -(xn * dY_dxn + yn * dY_dyn) * invF;
+			J[8 * num] = -(xn * dZ_dxn + yn * dZ_dyn) * invF;
+
+			//the extra parameters only change the incident angle
+			for (int k = 0; k < extraNum; k++)
+			{
+				double *Jk = J + (3 + k) * 3 * num;
+				Jk[0 * num] = dAngle[1 + k] * dX_dPhi;
+				Jk[1 * num] = dAngle[1 + k] * dY_dPhi;
+				Jk[2 * num] = dAngle[1 + k] * dZ_dPhi;
+			}
+		}
+		return validNum == num;
+	}
+
+	template<class Projector>
+	bool _mapS2IBatch(const double *X, const double *Y, const double *Z, int num,
+					  double *x, double *y, uchar *mask, Projector projector)
+	{
+		int validNum = 0;
+		for (int i = 0; i < num; i++)
+		{
+			double rho = sqrt(X[i] * X[i] + Y[i] * Y[i]);
+			double phi = atan2(rho, Z[i]);
+			double r_dist = 0;
+			bool valid = phi * 2 <= fov && projector(phi, r_dist);
+
+			//r_dist*cos(theta)*f = r_dist * f * X / rho, the same for y
+			double scale = rho > 0 ? r_dist * f / rho : 0;
+			x[i] = scale * X[i] + u0;
+			y[i] = -scale * Y[i] + v0;
+			mask[i] = valid ? 1 : 0;
+			validNum += valid ? 1 : 0;
+		}
+		return validNum == num;
+	}
+
 private:
 	CameraModel() {}
 };
 
 namespace FishEye
 {
+	//The real roots of a quadratic equation, num is 0, 1 or 2
+	struct QuadraticRoots
+	{
+		QuadraticRoots() : num(0) {}
+
+		int size() const { return num; }
+		const double &operator[](int i) const { return root[i]; }
+
+		int num;
+		double root[2];
+	};
+
 	//The solver for quadratic equation with one unknown
 	//a*x^2 + b*x + c = 0
-	inline std::vector<double> solverUnitaryQuadratic(const double &a, const double &b, const double &c)
+	//the two roots are q / a and c / q with q = -(b + sign(b) * sqrt(delta)) / 2,
+	//which avoids the cancellation in -b + sqrt(delta) or -b - sqrt(delta),
+	//they are ordered as (-b + sqrt(delta)) / 2a and (-b - sqrt(delta)) / 2a
+	inline QuadraticRoots solveQuadratic(const double &a, const double &b, const double &c)
 	{
-		std::vector<double> result;
-		result.reserve(2);
+		QuadraticRoots result;
 		if (a == 0)
 		{
 			if (b != 0)
 			{
-				result.push_back(-c / b);
+				result.root[result.num++] = -c / b;
 			}
+			return result;
 		}
-		else
+
+		double delta = b*b - 4 * a*c;
+		if (delta > 0)
 		{
-			double delta = b*b - 4 * a*c;
-			if (delta >= 0)
+			double sqrtDelta = sqrt(delta);
+			if (b >= 0)
 			{
-				if (delta > 0)
-				{
-					double sqrtDelta = sqrt(delta);
-					result.push_back((-b + sqrtDelta) / (2 * a));
-					result.push_back((-b - sqrtDelta) / (2 * a));
-				}
-				else
-				{
-					result.push_back(-b * 0.5 / a);
-				}
+				double q = -0.5 * (b + sqrtDelta);
+				result.root[0] = c / q;
+				result.root[1] = q / a;
+			}
+			else
+			{
+				double q = -0.5 * (b - sqrtDelta);
+				result.root[0] = q / a;
+				result.root[1] = c / q;
 			}
+			result.num = 2;
+		}
+		else if (delta == 0)
+		{
+			result.root[result.num++] = -b * 0.5 / a;
 		}
 		return result;
 	}
 
 
-	class Equidistant : public CameraModel
+	//The compile-time specialized front end of the fisheye models, Policy is the model
+	//class itself and provides inverseProject, project and inverseProjectDeriv.
+	//The mappings call them qualified by the policy, so they are bound statically and
+	//can be inlined into the loops, and the mappings are final, so a call through a
+	//reference of the model type (see visitCameraModel) has no virtual dispatch at all.
+	//The models are still created and passed as std::shared_ptr<CameraModel>
+	template<class Policy>
+	class TFishEyeModel : public CameraModel
+	{
+	public:
+		TFishEyeModel(double _u0, double _v0, double _f) : CameraModel(_u0, _v0, _f) {}
+		~TFishEyeModel() {}
+
+		using CameraModel::mapI2S;
+		using CameraModel::mapS2I;
+
+		virtual bool mapI2S(const cv::Point2d &imgPt, cv::Point3d &spherePt) final
+		{
+			return _mapI2S(imgPt, spherePt,
+				[this](const double &radius, double &angle)
+				{
+					return _lookupInverseTable(radius, angle) || _policy().Policy::inverseProject(radius, angle);
+				});
+		}
+
+		virtual bool mapS2I(const cv::Point3d &spherePt, cv::Point2d &imgPt) final
+		{
+			return _mapS2I(spherePt, imgPt,
+				[this](const double &angle, double &radius) { return _policy().Policy::project(angle, radius); });
+		}
+
+		virtual bool mapI2SBatch(const double *x, const double *y, int num,
+								 double *X, double *Y, double *Z, uchar *mask) final
+		{
+			return _mapI2SBatch(x, y, num, X, Y, Z, mask,
+				[this](const double &radius, double &angle)
+				{
+					return _lookupInverseTable(radius, angle) || _policy().Policy::inverseProject(radius, angle);
+				});
+		}
+
+		virtual bool mapS2IBatch(const double *X, const double *Y, const double *Z, int num,
+								 double *x, double *y, uchar *mask) final
+		{
+			return _mapS2IBatch(X, Y, Z, num, x, y, mask,
+				[this](const double &angle, double &radius) { return _policy().Policy::project(angle, radius); });
+		}
+
+		virtual bool mapI2SBatchDeriv(const double *x, const double *y, int num,
+									  double *X, double *Y, double *Z, uchar *mask, double *jac) final
+		{
+			return _mapI2SBatchDeriv(x, y, num, X, Y, Z, mask, jac,
+				[this](const double &radius, double &angle, double *dAngle) { return _policy().Policy::inverseProjectDeriv(radius, angle, dAngle); });
+		}
+
+	protected:
+		Policy &_policy() { return *static_cast<Policy *>(this); }
+	};
+
+	class Equidistant : public TFishEyeModel<Equidistant>
 	{
 	public:
 		Equidistant(double _u0, double _v0, double _f, double _fov) :
-			CameraModel(_u0, _v0, _f)
+			TFishEyeModel<Equidistant>(_u0, _v0, _f)
 		{
 			fov = _fov;
 			project(fov * 0.5, maxRadius);
@@ -163,6 +611,16 @@ namespace FishEye
 			return true;
 		}
 
+		virtual bool inverseProjectDeriv(const double& radius, double &angle, double *dAngle)
+		{
+			if (!Equidistant::inverseProject(radius, angle))
+			{
+				return false;
+			}
+			dAngle[0] = 1.0;
+			return true;
+		}
+
 		//projecting the incident angle to the imaging radius
 		virtual bool project(const double& angle, double &radius)
 		{
@@ -181,11 +639,11 @@ namespace FishEye
 		}
 	};
 
-	class Equisolid : public CameraModel
+	class Equisolid : public TFishEyeModel<Equisolid>
 	{
 	public:
 		Equisolid(double _u0, double _v0, double _f, double _fov) :
-			CameraModel(_u0, _v0, _f)
+			TFishEyeModel<Equisolid>(_u0, _v0, _f)
 		{
 			fov = _fov;
 			project(fov * 0.5, maxRadius);
@@ -205,6 +663,16 @@ namespace FishEye
 			return true;
 		}
 
+		virtual bool inverseProjectDeriv(const double& radius, double &angle, double *dAngle)
+		{
+			if (!Equisolid::inverseProject(radius, angle))
+			{
+				return false;
+			}
+			dAngle[0] = 1.0 / sqrt(1.0 - radius * radius * 0.25);
+			return true;
+		}
+
 		//projecting the incident angle to the imaging radius
 		virtual bool project(const double& angle, double &radius)
 		{
@@ -223,11 +691,11 @@ namespace FishEye
 		}
 	};
 
-	class Stereographic : public CameraModel
+	class Stereographic : public TFishEyeModel<Stereographic>
 	{
 	public:
 		Stereographic(double _u0, double _v0, double _f, double _fov) :
-			CameraModel(_u0, _v0, _f)
+			TFishEyeModel<Stereographic>(_u0, _v0, _f)
 		{
 			fov = _fov;
 			project(fov * 0.5, maxRadius);
@@ -246,6 +714,16 @@ namespace FishEye
 			return true;
 		}
 
+		virtual bool inverseProjectDeriv(const double& radius, double &angle, double *dAngle)
+		{
+			if (!Stereographic::inverseProject(radius, angle))
+			{
+				return false;
+			}
+			dAngle[0] = 1.0 / (1.0 + radius * radius * 0.25);
+			return true;
+		}
+
 		//projecting the incident angle to the imaging radius
 		virtual bool project(const double& angle, double &radius)
 		{
@@ -266,12 +744,12 @@ namespace FishEye
 
 
 	//Refer to : A Generic Camera Model and Calibration Method for Conventional, Wide-Angle, and Fish-Eye Lenses
-	class PolynomialAngle : public CameraModel
+	class PolynomialAngle : public TFishEyeModel<PolynomialAngle>
 	{
 	public:
 		PolynomialAngle(double _u0, double _v0, double _f, double _maxRadius,
 						double _k1 = 1.0, double _k2 = 0.0) :
-			k1(_k1), k2(_k2), CameraModel(_u0, _v0, _f)
+			k1(_k1), k2(_k2), TFishEyeModel<PolynomialAngle>(_u0, _v0, _f)
 		{
 			maxRadius = _maxRadius;
 			double tmpRadius = maxRadius / f;
@@ -358,6 +836,26 @@ namespace FishEye
 			return true;
 		}
 
+		//differentiate the implicit function k1 * angle + k2 * angle^3 - radius = 0
+		virtual bool inverseProjectDeriv(const double& radius, double &angle, double *dAngle)
+		{
+			if (!PolynomialAngle::inverseProject(radius, angle))
+			{
+				return false;
+			}
+
+			double D = k1 + 3 * k2 * angle * angle;
+			if (D == 0)
+			{
+				return false;
+			}
+
+			dAngle[0] = 1.0 / D;
+			dAngle[1] = -angle / D;
+			dAngle[2] = -angle * angle * angle / D;
+			return true;
+		}
+
 		//projecting the incident angle to the imaging radius
 		//radius = k1 * (angle) + k2 * (angle)^3
 		virtual bool project(const double& angle, double &radius)
@@ -381,12 +879,12 @@ namespace FishEye
 	};
 
 	//Refer to : A Toolbox for Easily Calibrating Omnidirectional
-	class PolynomialRadius : public CameraModel
+	class PolynomialRadius : public TFishEyeModel<PolynomialRadius>
 	{
 	public:
 		PolynomialRadius( double _u0, double _v0, double _f, double _maxRadius,
 						 double _a0 = 1.0, double _a2 = 0.0) :
-			a0(_a0), a2(_a2), CameraModel( _u0, _v0, _f)
+			a0(_a0), a2(_a2), TFishEyeModel<PolynomialRadius>(_u0, _v0, _f)
 		{
 			maxRadius = _maxRadius;
 			double tmpRadius = maxRadius / f;
@@ -412,6 +910,28 @@ namespace FishEye
 			return true;
 		}
 
+		//angle = atan2(rd, D) with D = a0 + a2*rd^2
+		virtual bool inverseProjectDeriv(const double& radius, double &angle, double *dAngle)
+		{
+			if (!PolynomialRadius::inverseProject(radius, angle))
+			{
+				return false;
+			}
+
+			double r2 = radius * radius;
+			double D = a0 + a2 * r2;
+			double N = r2 + D * D;
+			if (N == 0)
+			{
+				return false;
+			}
+
+			dAngle[0] = (a0 - a2 * r2) / N;
+			dAngle[1] = -radius / N;
+			dAngle[2] = -radius * r2 / N;
+			return true;
+		}
+
 		//projecting the incident angle to the imaging radius
 		//rd / (a0 + a2*rd^2) = sin(theta) / cos(theta)
 		//rd^2*a2*sin(theta) - rd*cos(theta) + a0*sin(theta) = 0
@@ -425,11 +945,11 @@ namespace FishEye
 			bool isInFov = angle <= fov * 0.5;
 
 			double a = a2 * sin(angle), b = -cos(angle), c = a0 * sin(angle);
-			std::vector<double> root = solverUnitaryQuadratic(a, b, c);
+			QuadraticRoots root = solveQuadratic(a, b, c);
 			radius = -1;
 			bool unique = false;
 
-			for (size_t i = 0; i < root.size(); i++)
+			for (int i = 0; i < root.size(); i++)
 			{
 				if (root[i] >= 0)
 				{
@@ -451,12 +971,12 @@ namespace FishEye
 	};
 
 	//Refer to : A unifying theory for central panoramic systems and practical implications
-	class GeyerModel : public CameraModel
+	class GeyerModel : public TFishEyeModel<GeyerModel>
 	{
 	public:
 		GeyerModel( double _u0, double _v0, double _f, double _maxRadius,
 				   double _m = 1.0, double _l = 0.0) :
-			m(_m), l(_l), CameraModel(_u0, _v0, _f)
+			m(_m), l(_l), TFishEyeModel<GeyerModel>(_u0, _v0, _f)
 		{
 			maxRadius = _maxRadius;
 			double tmpRadius = maxRadius / f;
@@ -490,13 +1010,12 @@ namespace FishEye
 			double c = d*d - 1;
 			double cosValue = 0;
 
-			std::vector<double> root = solverUnitaryQuadratic(a, b, c);
-			int rootNum = root.size();
+			QuadraticRoots root = solveQuadratic(a, b, c);
 			angle = -1;
 			bool unique = false;
 
 			//obtain the smaller one
-			for (size_t i = 0; i < root.size(); i++)
+			for (int i = 0; i < root.size(); i++)
 			{
 				double cosValue = root[i];
 				if (abs(cosValue) <= 1)
@@ -522,6 +1041,27 @@ namespace FishEye
 			return unique;
 		}
 
+		//differentiate the implicit function (m + l)*sin(theta) - rd*(l + cos(theta)) = 0
+		virtual bool inverseProjectDeriv(const double& radius, double &angle, double *dAngle)
+		{
+			if (!GeyerModel::inverseProject(radius, angle))
+			{
+				return false;
+			}
+
+			double sinA = sin(angle), cosA = cos(angle);
+			double dF_dAngle = (m + l) * cosA + radius * sinA;
+			if (dF_dAngle == 0)
+			{
+				return false;
+			}
+
+			dAngle[0] = (l + cosA) / dF_dAngle;
+			dAngle[1] = -sinA / dF_dAngle;
+			dAngle[2] = (radius - sinA) / dF_dAngle;
+			return true;
+		}
+
 		//projecting the incident angle to the imaging radius
 		//rd = (m + l)*sin(theta) / ( l + cos(theta))
 		virtual bool project(const double& angle, double &radius)
@@ -583,6 +1123,24 @@ inline std::shared_ptr<CameraModel> createCameraModel(const std::string &typeNam
 	return result;
 }
 
-
-
-
+//Call visitor(model) with the reference of the concrete model type, so that a generic
+//algorithm is instantiated for every fisheye model and its mapping calls are bound
+//statically, the other models are passed as CameraModel and use the virtual calls
+template<class Visitor>
+inline void visitCameraModel(CameraModel &model, Visitor visitor)
+{
+	if (FishEye::Equidistant *p = dynamic_cast<FishEye::Equidistant *>(&model))
+		visitor(*p);
+	else if (FishEye::Equisolid *p = dynamic_cast<FishEye::Equisolid *>(&model))
+		visitor(*p);
+	else if (FishEye::Stereographic *p = dynamic_cast<FishEye::Stereographic *>(&model))
+		visitor(*p);
+	else if (FishEye::PolynomialAngle *p = dynamic_cast<FishEye::PolynomialAngle *>(&model))
+		visitor(*p);
+	else if (FishEye::PolynomialRadius *p = dynamic_cast<FishEye::PolynomialRadius *>(&model))
+		visitor(*p);
+	else if (FishEye::GeyerModel *p = dynamic_cast<FishEye::GeyerModel *>(&model))
+		visitor(*p);
+	else
+		visitor(model);
+}
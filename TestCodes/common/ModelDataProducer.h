@@ -2,9 +2,9 @@
 
 #include "CameraModel.h"
 #include "Rotation.h"
+#include "RandomStream.h"
 #include <fstream>
-#include <chrono>
-#include <random>
+#include <algorithm>
 
 class ModelDataProducer
 {
@@ -12,53 +12,117 @@ public:
 	ModelDataProducer() { mcount = 0; }
 	~ModelDataProducer(){}
 
+	//all the random values are drawn from rng, so the data only depends on its stream.
+	//Without the translation the pairs are sampled directly inside the overlap of the two
+	//views, with it (whose overlap is not the one of the rotation) phi and theta are drawn
+	//uniformly and the pairs out of the fov are rejected, as the original sampler did.
+	//The pairs are mapped block by block with the batch mapping
 	void produce(std::shared_ptr<CameraModel> &pCam, std::shared_ptr<Rotation> &pRot,
-				 int pairNum, double sigma, double translateLen)
+				 int pairNum, double sigma, double translateLen, RandomStream &rng)
 	{
 		assert(pairNum > 0 && pCam.use_count() != 0 && pRot.use_count() != 0);
 		mpCam = pCam;
 		mpRot = pRot;
 
-		if (!mvImgPt1.empty())mvImgPt1.clear();
-		if (!mvImgPt2.empty())mvImgPt2.clear();
-		if (!mvSpherePt1.empty())mvSpherePt1.clear();
-		if (!mvSpherePt2.empty())mvSpherePt2.clear();
+		mvImgPt1.clear();
+		mvImgPt2.clear();
+		mvSpherePt1.clear();
+		mvSpherePt2.clear();
+		mvImgPt1.reserve(pairNum);
+		mvImgPt2.reserve(pairNum);
+		mvSpherePt1.reserve(pairNum);
+		mvSpherePt2.reserve(pairNum);
 
-		cv::Vec3d direction = RandomAxis();
+		cv::Vec3d direction = rng.axis();
 		cv::Vec3d translate = translateLen * direction;
-		
 
 		mcount = 0;
+		bool rejection = translateLen != 0;
+		OverlapSampler sampler(pCam->fov, *pRot);
+		if (!rejection && sampler.empty())
+		{
+			std::cout << "Warning: No overlap between the two views in produce" << std::endl;
+			return;
+		}
+
+		//the pairs out of the fov are dropped by the mask of the batch mapping, the
+		//production gives up after maxRejected samples in a row are dropped
+		const int blockSize = 4096, maxRejected = 16 * blockSize;
+		int rejected = 0;
+		SpherePointArray spherePts1, spherePts2;
+		ImagePointArray imgPts1, imgPts2;
+		std::vector<uchar> mask1, mask2;
+		const double *pR = pRot->R.val;
 		while (mcount < pairNum)
 		{
-			double phi = pCam->fov * (rand() / double(RAND_MAX)) * 0.5;
-			double theta = CV_2PI * (rand() / double(RAND_MAX));
+			if (rejected >= maxRejected)
+			{
+				std::cout << "Warning: The translated pairs are out of the fov in produce, only "
+					<< mcount << " of " << pairNum << " pairs" << std::endl;
+				return;
+			}
 
-			cv::Point3d spherePt(sin(phi)*cos(theta), sin(phi)*sin(theta), cos(phi));
-			cv::Point3d spherePtByRot = RotatePoint(spherePt, *pRot) + cv::Point3d(translate);
+			int num = std::min(blockSize, pairNum - mcount);
+			spherePts1.resize(num);
+			spherePts2.resize(num);
+			for (int i = 0; i < num; i++)
+			{
+				double phi, theta;
+				if (rejection)
+				{
+					phi = pCam->fov * rng.uniform() * 0.5;
+					theta = CV_2PI * rng.uniform();
+				}
+				else sampler.sample(rng, phi, theta);
+				double sinPhi = sin(phi);
+				double X = sinPhi * cos(theta), Y = sinPhi * sin(theta), Z = cos(phi);
+				spherePts1.x[i] = X;
+				spherePts1.y[i] = Y;
+				spherePts1.z[i] = Z;
+				spherePts2.x[i] = pR[0] * X + pR[1] * Y + pR[2] * Z + translate[0];
+				spherePts2.y[i] = pR[3] * X + pR[4] * Y + pR[5] * Z + translate[1];
+				spherePts2.z[i] = pR[6] * X + pR[7] * Y + pR[8] * Z + translate[2];
+			}
 
-			double phiByRot = atan2(sqrt(spherePtByRot.x*spherePtByRot.x +
-										 spherePtByRot.y*spherePtByRot.y), spherePtByRot.z);
-			if (phiByRot * 2 > pCam->fov) continue;
+			imgPts1.resize(num);
+			imgPts2.resize(num);
+			mask1.resize(num);
+			mask2.resize(num);
+			visitCameraModel(*pCam, [&](auto &model)
+			{
+				model.mapS2IBatch(spherePts1.x.data(), spherePts1.y.data(), spherePts1.z.data(), num,
+								  imgPts1.x.data(), imgPts1.y.data(), mask1.data());
+				model.mapS2IBatch(spherePts2.x.data(), spherePts2.y.data(), spherePts2.z.data(), num,
+								  imgPts2.x.data(), imgPts2.y.data(), mask2.data());
+			});
 
-			cv::Point2d imgPt, imgPtByRot;
-			pCam->mapS2I(spherePt, imgPt);
-			pCam->mapS2I(spherePtByRot, imgPtByRot);
-			mvSpherePt1.push_back(spherePt);
-			mvSpherePt2.push_back(spherePtByRot);
+			for (int i = 0; i < num; i++)
+			{
+				if (!mask1[i] || !mask2[i])
+				{
+					rejected++;
+					continue;
+				}
+				rejected = 0;
 
-			imgPt += cv::Point2d(_randPixel(sigma), _randPixel(sigma));
-			imgPtByRot += cv::Point2d(_randPixel(sigma), _randPixel(sigma));
+				mvSpherePt1.push_back(cv::Point3d(spherePts1.x[i], spherePts1.y[i], spherePts1.z[i]));
+				mvSpherePt2.push_back(cv::Point3d(spherePts2.x[i], spherePts2.y[i], spherePts2.z[i]));
 
-			mvImgPt1.push_back(imgPt);
-			mvImgPt2.push_back(imgPtByRot);
-			mcount++;
+				cv::Point2d imgPt(imgPts1.x[i], imgPts1.y[i]), imgPtByRot(imgPts2.x[i], imgPts2.y[i]);
+				imgPt += cv::Point2d(_randPixel(sigma, rng), _randPixel(sigma, rng));
+				imgPtByRot += cv::Point2d(_randPixel(sigma, rng), _randPixel(sigma, rng));
+
+				mvImgPt1.push_back(imgPt);
+				mvImgPt2.push_back(imgPtByRot);
+				mcount++;
+			}
 		}
 	}
 
+	//a trial without pairs (see produce) is written with only its header lines
 	std::string writeToFile(std::ofstream &fs)
 	{
-		assert(mcount > 0 && mpCam.use_count() != 0 && mpRot.use_count() != 0 && fs.is_open());
+		assert(mcount >= 0 && mpCam.use_count() != 0 && mpRot.use_count() != 0 && fs.is_open());
 
 		std::string typeName = mpCam->getTypeName();
 		fs << mcount << " " << typeName << std::endl;
@@ -87,8 +151,9 @@ public:
 		fs >> u0 >> v0 >> f >> fov >> maxRadius;
 		mpCam = createCameraModel(typeName, u0, v0, f, fov, maxRadius);
 
-		mpRot = std::make_shared<Rotation>();
-		fs >> mpRot->axisAngle[0] >> mpRot->axisAngle[1] >> mpRot->axisAngle[2];
+		cv::Vec3d axisAngle;
+		fs >> axisAngle[0] >> axisAngle[1] >> axisAngle[2];
+		mpRot = std::make_shared<Rotation>(axisAngle);
 		mvImgPt1.resize(mcount); 
 		mvImgPt2.resize(mcount);
 		mvSpherePt1.resize(mcount);
@@ -113,24 +178,87 @@ public:
 	int mcount;
 
 private:
-	double _randNormal(double &start, double &end, double &mean, double &sigma)
+	//Sample (phi, theta) with phi uniform in [0, fov/2] and theta uniform in [0, 2pi)
+	//conditioned on the rotated point staying in the fov. For a given phi the rotated
+	//z = rxy*sin(phi)*cos(theta - psi) + r33*cos(phi) >= cos(fov/2) holds on an arc of theta,
+	//so phi is drawn from the tabulated arc lengths and theta uniformly on the arc
+	class OverlapSampler
+	{
+	public:
+		OverlapSampler(double fov, const Rotation &rot)
+		{
+			const double *pR = rot.R.val;
+			mRxy = sqrt(pR[6] * pR[6] + pR[7] * pR[7]);
+			mPsi = atan2(pR[7], pR[6]);
+			mR33 = pR[8];
+			mCosHalfFov = cos(fov * 0.5);
+
+			const int nodeNum = 1025;
+			mPhiStep = std::min(fov * 0.5, CV_PI) / (nodeNum - 1);
+			mvLength.resize(nodeNum);
+			mvCdf.resize(nodeNum);
+			mvCdf[0] = 0;
+			for (int k = 0; k < nodeNum; k++)
+			{
+				mvLength[k] = std::max(_halfArc(k * mPhiStep), 0.0);
+				if (k > 0) mvCdf[k] = mvCdf[k - 1] + 0.5 * (mvLength[k - 1] + mvLength[k]);
+			}
+		}
+
+		bool empty() const { return mvCdf.back() <= 0; }
+
+		void sample(RandomStream &rng, double &phi, double &theta) const
+		{
+			int binNum = int(mvCdf.size()) - 1;
+			double halfArc = -1;
+			//the linear interpolation of the arc lengths may be positive where the
+			//arc is empty at the end of the overlap, such rare samples are redrawn
+			while (halfArc < 0)
+			{
+				double u = rng.uniform() * mvCdf.back();
+				int k = int(std::upper_bound(mvCdf.begin(), mvCdf.end(), u) - mvCdf.begin()) - 1;
+				k = std::max(0, std::min(k, binNum - 1));
+
+				//invert la*t + (lb - la)*t^2/2 = w in the bin with linear density
+				double la = mvLength[k], lb = mvLength[k + 1], w = u - mvCdf[k];
+				double denom = la + sqrt(std::max(la * la + 2 * (lb - la) * w, 0.0));
+				double t = denom > 0 ? 2 * w / denom : 0;
+				phi = (k + std::max(0.0, std::min(t, 1.0))) * mPhiStep;
+				halfArc = _halfArc(phi);
+			}
+			theta = mPsi + (2 * rng.uniform() - 1) * halfArc;
+		}
+
+	private:
+		//the half length of the valid theta arc, negative when there is none
+		double _halfArc(double phi) const
+		{
+			double a = mRxy * sin(phi), b = mR33 * cos(phi);
+			if (a < 1e-12) return b >= mCosHalfFov ? CV_PI : -1;
+
+			double q = (mCosHalfFov - b) / a;
+			if (q <= -1) return CV_PI;
+			if (q > 1) return -1;
+			return acos(q);
+		}
+
+		double mRxy, mPsi, mR33, mCosHalfFov, mPhiStep;
+		std::vector<double> mvLength, mvCdf;
+	};
+
+	double _randNormal(double start, double end, double mean, double sigma, RandomStream &rng)
 	{
-		unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-		std::default_random_engine generator(seed);
-		std::normal_distribution<double> distribution(mean, sigma);
-		double result = distribution(generator);
+		double result = rng.normal(mean, sigma);
 		while (result < start || result > end)
 		{
-			result = distribution(generator);
+			result = rng.normal(mean, sigma);
 		}
 
 		return result;
 	}
 
-	double _randPixel(double sigma)
+	double _randPixel(double sigma, RandomStream &rng)
 	{
-		
-		double ratio = rand() / double(RAND_MAX);
-		return ratio * (2 * sigma) - sigma;
+		return rng.uniform() * (2 * sigma) - sigma;
 	}
 };
@@ -0,0 +1,86 @@
+#include "ModelDataset.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace ModelDataset
+{
+	MappedFile::MappedFile() : mpData(NULL), mSize(0), mhFile(NULL), mhMapping(NULL), mFd(-1)
+	{
+#ifdef _WIN32
+		mhFile = INVALID_HANDLE_VALUE;
+#endif
+	}
+
+	bool MappedFile::open(const std::string &fileName)
+	{
+		close();
+#ifdef _WIN32
+		mhFile = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+							 OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (mhFile == INVALID_HANDLE_VALUE) return false;
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(mhFile, &fileSize) || fileSize.QuadPart == 0)
+		{
+			close();
+			return false;
+		}
+		mSize = size_t(fileSize.QuadPart);
+
+		mhMapping = CreateFileMappingA(mhFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mhMapping != NULL)
+			mpData = reinterpret_cast<const char *>(MapViewOfFile(mhMapping, FILE_MAP_READ, 0, 0, 0));
+#else
+		mFd = ::open(fileName.c_str(), O_RDONLY);
+		if (mFd < 0) return false;
+
+		struct stat st;
+		if (fstat(mFd, &st) != 0 || st.st_size == 0)
+		{
+			close();
+			return false;
+		}
+		mSize = size_t(st.st_size);
+
+		void *pData = mmap(NULL, mSize, PROT_READ, MAP_PRIVATE, mFd, 0);
+		if (pData != MAP_FAILED)
+			mpData = reinterpret_cast<const char *>(pData);
+#endif
+		if (mpData == NULL)
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void MappedFile::close()
+	{
+#ifdef _WIN32
+		if (mpData != NULL) UnmapViewOfFile(mpData);
+		if (mhMapping != NULL) CloseHandle(mhMapping);
+		if (mhFile != INVALID_HANDLE_VALUE) CloseHandle(mhFile);
+		mhMapping = NULL;
+		mhFile = INVALID_HANDLE_VALUE;
+#else
+		if (mpData != NULL) munmap(const_cast<char *>(mpData), mSize);
+		if (mFd >= 0) ::close(mFd);
+		mFd = -1;
+#endif
+		mpData = NULL;
+		mSize = 0;
+	}
+}
@@ -0,0 +1,334 @@
+#pragma once
+
+#include "ModelDataProducer.h"
+#include <cstdint>
+#include <cstring>
+
+//The binary container of the synthetic data, all the values are stored in the native
+//(little-endian) byte order and every block starts at a multiple of 8 bytes
+//
+//  DatasetHeader
+//  the point arrays of trial 0, trial 1, ...
+//  DatasetTrialRecord[trialNum]                  (at DatasetHeader::recordOffset)
+//
+//The point arrays of a trial are 10 contiguous arrays of pairNum doubles:
+//  imgX1, imgY1, imgX2, imgY2, sphereX1, sphereY1, sphereZ1, sphereX2, sphereY2, sphereZ2
+//so they can be used directly by the batch mapping of CameraModel
+namespace ModelDataset
+{
+	const char MAGIC[8] = { 'F', 'I', 'S', 'H', 'D', 'A', 'T', 'A' };
+	const uint32_t VERSION = 1;
+	const int POINT_ARRAY_NUM = 10;
+
+	struct DatasetHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t trialNum;
+		uint64_t recordOffset;
+		uint64_t reserved;
+	};
+
+	struct DatasetTrialRecord
+	{
+		char typeName[32];
+		double u0, v0, f, fov, maxRadius;
+		double axisAngle[3];
+		int32_t pairNum;
+		int32_t reserved;
+		uint64_t pointOffset;
+	};
+
+	static_assert(sizeof(DatasetHeader) == 32, "unexpected padding in DatasetHeader");
+	static_assert(sizeof(DatasetTrialRecord) == 112, "unexpected padding in DatasetTrialRecord");
+
+	//The zero-copy view of one trial, the pointers refer to the mapped file
+	struct TrialView
+	{
+		const DatasetTrialRecord *record;
+		int pairNum;
+		const double *imgX1, *imgY1, *imgX2, *imgY2;
+		const double *sphereX1, *sphereY1, *sphereZ1;
+		const double *sphereX2, *sphereY2, *sphereZ2;
+	};
+
+	//Write the trials one by one, the records are kept in memory
+	//and written at the end of the file by close()
+	class Writer
+	{
+	public:
+		Writer() {}
+		Writer(const std::string &fileName) { open(fileName); }
+		~Writer() { close(); }
+
+		bool open(const std::string &fileName)
+		{
+			close();
+			mFs.open(fileName, std::ios::out | std::ios::binary);
+			if (!mFs.is_open())
+				return false;
+
+			//the header is rewritten by close() when the records are known
+			DatasetHeader header;
+			memset(&header, 0, sizeof(header));
+			mFs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+			mvRecord.clear();
+			return true;
+		}
+
+		bool isOpened() const { return mFs.is_open(); }
+
+		void write(const ModelDataProducer &modelData)
+		{
+			assert(mFs.is_open() && modelData.mcount >= 0);
+
+			DatasetTrialRecord record;
+			memset(&record, 0, sizeof(record));
+			std::string typeName = modelData.mpCam->getTypeName();
+			strncpy(record.typeName, typeName.c_str(), sizeof(record.typeName) - 1);
+			record.u0 = modelData.mpCam->u0;
+			record.v0 = modelData.mpCam->v0;
+			record.f = modelData.mpCam->f;
+			record.fov = modelData.mpCam->fov;
+			record.maxRadius = modelData.mpCam->maxRadius;
+			for (int k = 0; k < 3; k++)
+			{
+				record.axisAngle[k] = modelData.mpRot->axisAngle[k];
+			}
+			record.pairNum = modelData.mcount;
+			record.pointOffset = uint64_t(mFs.tellp());
+
+			int num = modelData.mcount;
+			std::vector<double> buffer(size_t(num) * POINT_ARRAY_NUM);
+			double *pArray[POINT_ARRAY_NUM];
+			for (int k = 0; k < POINT_ARRAY_NUM; k++)
+			{
+				pArray[k] = buffer.data() + size_t(k) * num;
+			}
+			for (int i = 0; i < num; i++)
+			{
+				const cv::Point2d &imgPt1 = modelData.mvImgPt1[i], &imgPt2 = modelData.mvImgPt2[i];
+				const cv::Point3d &spherePt1 = modelData.mvSpherePt1[i], &spherePt2 = modelData.mvSpherePt2[i];
+				pArray[0][i] = imgPt1.x; pArray[1][i] = imgPt1.y;
+				pArray[2][i] = imgPt2.x; pArray[3][i] = imgPt2.y;
+				pArray[4][i] = spherePt1.x; pArray[5][i] = spherePt1.y; pArray[6][i] = spherePt1.z;
+				pArray[7][i] = spherePt2.x; pArray[8][i] = spherePt2.y; pArray[9][i] = spherePt2.z;
+			}
+			mFs.write(reinterpret_cast<const char *>(buffer.data()), buffer.size() * sizeof(double));
+			mvRecord.push_back(record);
+		}
+
+		void close()
+		{
+			if (!mFs.is_open())
+				return;
+
+			DatasetHeader header;
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, MAGIC, sizeof(MAGIC));
+			header.version = VERSION;
+			header.trialNum = uint32_t(mvRecord.size());
+			header.recordOffset = uint64_t(mFs.tellp());
+
+			if (!mvRecord.empty())
+			{
+				mFs.write(reinterpret_cast<const char *>(mvRecord.data()), mvRecord.size() * sizeof(DatasetTrialRecord));
+			}
+			mFs.seekp(0);
+			mFs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+			mFs.close();
+			mvRecord.clear();
+		}
+
+	private:
+		std::ofstream mFs;
+		std::vector<DatasetTrialRecord> mvRecord;
+	};
+
+	//The read-only mapping of a whole file, the platform code is in ModelDataset.cpp
+	//so the system headers stay out of this one
+	class MappedFile
+	{
+	public:
+		MappedFile();
+		~MappedFile() { close(); }
+		MappedFile(const MappedFile &) = delete;
+		MappedFile &operator=(const MappedFile &) = delete;
+
+		//an empty file can not be mapped and fails
+		bool open(const std::string &fileName);
+		void close();
+
+		const char *data() const { return mpData; }
+		size_t size() const { return mSize; }
+
+	private:
+		const char *mpData;
+		size_t mSize;
+		//the file and the mapping handles on Windows, the descriptor elsewhere
+		void *mhFile, *mhMapping;
+		int mFd;
+	};
+
+	//Map the whole file into memory, the trials can be accessed
+	//in any order without parsing the ones before them
+	class Reader
+	{
+	public:
+		Reader() : mpData(NULL), mSize(0), mpHeader(NULL), mpRecord(NULL) {}
+		Reader(const std::string &fileName) : Reader() { open(fileName); }
+		~Reader() { close(); }
+		Reader(const Reader &) = delete;
+		Reader &operator=(const Reader &) = delete;
+
+		bool open(const std::string &fileName)
+		{
+			close();
+			if (!mFile.open(fileName))
+			{
+				std::cout << "Failed to map the file " << fileName << std::endl;
+				close();
+				return false;
+			}
+			mpData = mFile.data();
+			mSize = mFile.size();
+
+			//the offsets are checked against the file size before they are used, written as
+			//subtractions so a corrupted offset can not overflow the sums
+			mpHeader = reinterpret_cast<const DatasetHeader *>(mpData);
+			if (mSize < sizeof(DatasetHeader) || memcmp(mpHeader->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+				mpHeader->version != VERSION ||
+				mpHeader->recordOffset < sizeof(DatasetHeader) || mpHeader->recordOffset % sizeof(double) != 0 ||
+				mpHeader->recordOffset > mSize ||
+				uint64_t(mpHeader->trialNum) * sizeof(DatasetTrialRecord) > mSize - mpHeader->recordOffset)
+			{
+				std::cout << "Invalid dataset file " << fileName << std::endl;
+				close();
+				return false;
+			}
+
+			mpRecord = reinterpret_cast<const DatasetTrialRecord *>(mpData + mpHeader->recordOffset);
+			for (int i = 0; i < getTrialNum(); i++)
+			{
+				const DatasetTrialRecord &record = mpRecord[i];
+				uint64_t pointSize = uint64_t(record.pairNum) * POINT_ARRAY_NUM * sizeof(double);
+				if (record.pairNum < 0 || record.pointOffset % sizeof(double) != 0 ||
+					record.pointOffset < sizeof(DatasetHeader) || record.pointOffset > mpHeader->recordOffset ||
+					pointSize > mpHeader->recordOffset - record.pointOffset)
+				{
+					std::cout << "Invalid trial record " << i << " in " << fileName << std::endl;
+					close();
+					return false;
+				}
+			}
+			return true;
+		}
+
+		bool isOpened() const { return mpHeader != NULL; }
+
+		int getTrialNum() const { return mpHeader == NULL ? 0 : int(mpHeader->trialNum); }
+
+		TrialView getTrial(int idx) const
+		{
+			assert(isOpened() && idx >= 0 && idx < getTrialNum());
+			const DatasetTrialRecord &record = mpRecord[idx];
+			const double *pPoint = reinterpret_cast<const double *>(mpData + record.pointOffset);
+			int num = record.pairNum;
+
+			TrialView view;
+			view.record = &record;
+			view.pairNum = num;
+			view.imgX1 = pPoint; view.imgY1 = pPoint + num;
+			view.imgX2 = pPoint + 2 * num; view.imgY2 = pPoint + 3 * num;
+			view.sphereX1 = pPoint + 4 * num; view.sphereY1 = pPoint + 5 * num; view.sphereZ1 = pPoint + 6 * num;
+			view.sphereX2 = pPoint + 7 * num; view.sphereY2 = pPoint + 8 * num; view.sphereZ2 = pPoint + 9 * num;
+			return view;
+		}
+
+		//copy one trial out of the mapped file
+		std::shared_ptr<ModelDataProducer> loadTrial(int idx) const
+		{
+			TrialView view = getTrial(idx);
+			const DatasetTrialRecord &record = *view.record;
+
+			std::shared_ptr<ModelDataProducer> pModelData = std::make_shared<ModelDataProducer>();
+			std::string typeName(record.typeName, strnlen(record.typeName, sizeof(record.typeName)));
+			pModelData->mpCam = createCameraModel(typeName, record.u0, record.v0, record.f, record.fov, record.maxRadius);
+			pModelData->mpRot = std::make_shared<Rotation>(cv::Vec3d(record.axisAngle[0], record.axisAngle[1], record.axisAngle[2]));
+
+			int num = view.pairNum;
+			pModelData->mcount = num;
+			pModelData->mvImgPt1.resize(num);
+			pModelData->mvImgPt2.resize(num);
+			pModelData->mvSpherePt1.resize(num);
+			pModelData->mvSpherePt2.resize(num);
+			for (int i = 0; i < num; i++)
+			{
+				pModelData->mvImgPt1[i] = cv::Point2d(view.imgX1[i], view.imgY1[i]);
+				pModelData->mvImgPt2[i] = cv::Point2d(view.imgX2[i], view.imgY2[i]);
+				pModelData->mvSpherePt1[i] = cv::Point3d(view.sphereX1[i], view.sphereY1[i], view.sphereZ1[i]);
+				pModelData->mvSpherePt2[i] = cv::Point3d(view.sphereX2[i], view.sphereY2[i], view.sphereZ2[i]);
+			}
+			return pModelData;
+		}
+
+		void close()
+		{
+			mFile.close();
+			mpData = NULL;
+			mSize = 0;
+			mpHeader = NULL;
+			mpRecord = NULL;
+		}
+
+	private:
+		MappedFile mFile;
+		const char *mpData;
+		size_t mSize;
+		const DatasetHeader *mpHeader;
+		const DatasetTrialRecord *mpRecord;
+	};
+
+	//convert the text file written by ModelDataProducer::writeToFile to the binary container
+	inline bool ConvertTextToBinary(const std::string &textFile, const std::string &binaryFile)
+	{
+		std::ifstream fs(textFile, std::ios::in);
+		if (!fs.is_open())
+			return false;
+
+		Writer writer(binaryFile);
+		if (!writer.isOpened())
+			return false;
+
+		int trialNum;
+		fs >> trialNum;
+		ModelDataProducer modelData;
+		for (int i = 0; i < trialNum; i++)
+		{
+			modelData.readFromFile(fs);
+			writer.write(modelData);
+		}
+		writer.close();
+		return true;
+	}
+
+	//convert the binary container to the text file read by ModelDataProducer::readFromFile
+	inline bool ConvertBinaryToText(const std::string &binaryFile, const std::string &textFile)
+	{
+		Reader reader(binaryFile);
+		if (!reader.isOpened())
+			return false;
+
+		std::ofstream fs(textFile, std::ios::out);
+		if (!fs.is_open())
+			return false;
+
+		fs << reader.getTrialNum() << std::endl;
+		for (int i = 0; i < reader.getTrialNum(); i++)
+		{
+			reader.loadTrial(i)->writeToFile(fs);
+		}
+		fs.close();
+		return true;
+	}
+}
@@ -7,10 +7,82 @@
 
 
 #include <opencv2/core/ocl.hpp>
+#include <fstream>
 
 namespace cv
 {
 
+//The normal equations A = J^T * J, v = J^T * r and S = r^T * r accumulated block by block,
+//so J and r can be streamed through in blocks. getA reads the upper triangle of A
+class NormalEquation
+{
+public:
+	NormalEquation() : paramNum(0), S(0), maxAbsR(0) {}
+	NormalEquation(int _paramNum) { reset(_paramNum); }
+
+	void reset(int _paramNum)
+	{
+		paramNum = _paramNum;
+		vA.assign(size_t(paramNum) * paramNum, 0);
+		vV.assign(paramNum, 0);
+		S = maxAbsR = 0;
+	}
+
+	//add the rows [J, r], J is rowNum x paramNum with the row step jStep (in elements),
+	//the block products go through gemm the same as mulTransposed(J, A, true) did
+	void addRows(const double *J, size_t jStep, const double *r, int rowNum)
+	{
+		if (rowNum <= 0) return;
+		Mat Jb(rowNum, paramNum, CV_64F, const_cast<double *>(J), jStep * sizeof(double));
+		Mat rb(rowNum, 1, CV_64F, const_cast<double *>(r));
+		Mat A(paramNum, paramNum, CV_64F, vA.data()), v(paramNum, 1, CV_64F, vV.data());
+		gemm(Jb, Jb, 1, A, 1, A, GEMM_1_T);
+		gemm(Jb, rb, 1, v, 1, v, GEMM_1_T);
+		addResiduals(r, rowNum);
+	}
+
+	//add the residuals only, A and v are untouched
+	void addResiduals(const double *r, int rowNum)
+	{
+		for (int k = 0; k < rowNum; k++)
+		{
+			S += r[k] * r[k];
+			maxAbsR = std::max(maxAbsR, std::abs(r[k]));
+		}
+	}
+
+	//add another accumulation, the order of the additions is up to the caller
+	void add(const NormalEquation &other)
+	{
+		CV_Assert(other.paramNum == paramNum);
+		for (size_t i = 0; i < vA.size(); i++) vA[i] += other.vA[i];
+		for (size_t i = 0; i < vV.size(); i++) vV[i] += other.vV[i];
+		S += other.S;
+		maxAbsR = std::max(maxAbsR, other.maxAbsR);
+	}
+
+	void getA(Mat &A) const
+	{
+		A.create(paramNum, paramNum, CV_64F);
+		for (int p = 0; p < paramNum; p++)
+		{
+			for (int q = p; q < paramNum; q++)
+			{
+				A.at<double>(p, q) = A.at<double>(q, p) = vA[p * paramNum + q];
+			}
+		}
+	}
+
+	void getV(Mat &v) const
+	{
+		Mat(paramNum, 1, CV_64F, const_cast<double *>(vV.data())).copyTo(v);
+	}
+
+	int paramNum;
+	std::vector<double> vA, vV;
+	double S, maxAbsR;
+};
+
 class CV_EXPORTS LMSolver : public Algorithm
 {
 public:
@@ -21,29 +93,187 @@ public:
         virtual bool compute(InputArray param, OutputArray err, OutputArray J) const = 0;
     };
 
+    //The matrix-free callback, it returns only the reduced A, v and S instead of
+    //the residual and the Jacobian, so the memory does not grow with the rows.
+    //LMSolverImpl uses computeNormal whenever isMatrixFree() is true
+    class CV_EXPORTS NormalCallback : public Callback
+    {
+    public:
+        virtual bool isMatrixFree() const { return true; }
+
+        //normal is reset to param.rows parameters, only S and maxAbsR are
+        //filled if needJacobian is false
+        virtual bool computeNormal(InputArray param, NormalEquation &normal, bool needJacobian) const = 0;
+    };
+
     virtual void setCallback(const Ptr<LMSolver::Callback>& cb) = 0;
     virtual int run(InputOutputArray _param0) const = 0;
 };
 
+//why LMSolverImpl::run stopped
+enum LMTerminationReason
+{
+	LM_TERM_NONE,
+	//the converged ones
+	LM_TERM_SMALL_STEP, LM_TERM_SMALL_RESIDUAL, LM_TERM_SMALL_DECREASE, LM_TERM_SMALL_GRADIENT, LM_TERM_STALL,
+	//the budgets
+	LM_TERM_MAX_ITERS, LM_TERM_MAX_EVALUATIONS, LM_TERM_TIME_LIMIT,
+	//the callback failed
+	LM_TERM_FAILED
+};
+
+inline const char *LMTerminationName(LMTerminationReason reason)
+{
+	static const char *names[] = { "none", "small step", "small residual", "small decrease", "small gradient",
+								   "stall", "max iterations", "max evaluations", "time limit", "failed" };
+	return names[reason];
+}
+
+//the outcome of one LMSolverImpl::run
+struct LMSummary
+{
+	LMSummary() : reason(LM_TERM_NONE), iterations(0), nfJ(0), initialS(0), finalS(0) {}
+
+	LMTerminationReason reason;
+	int iterations, nfJ;
+	double initialS, finalS;
+};
+
+//The state of one LM iteration, iter 0 is the initial evaluation. The seconds are
+//spent in this iteration: residualSeconds by the residual-only evaluations of the trial
+//steps, jacobianSeconds by the evaluations with the Jacobian (or the normal equations),
+//solveSeconds by the damped system and the lambda reset
+struct LMIterationInfo
+{
+	int iter, nfJ;
+	//S after the iteration and the infinity norm of the step
+	double S, stepNorm, lambda;
+	bool accepted;
+	double residualSeconds, jacobianSeconds, solveSeconds;
+};
+
+//the per-iteration hook of LMSolverImpl, nothing is measured without it
+class LMTelemetry
+{
+public:
+	virtual ~LMTelemetry() {}
+	virtual void onIteration(const LMIterationInfo &info) = 0;
+	//iterations is the value returned by run
+	virtual void onFinish(int iterations) {}
+};
+
+//keep all the iterations in memory, the runs are appended
+class LMMemoryTelemetry : public LMTelemetry
+{
+public:
+	void onIteration(const LMIterationInfo &info) { records.push_back(info); }
+
+	std::vector<LMIterationInfo> records;
+};
+
+//write one CSV line per iteration, a run ends with an empty line
+class LMCsvTelemetry : public LMTelemetry
+{
+public:
+	LMCsvTelemetry(const std::string &fileName) : fs(fileName, std::ios::out)
+	{
+		if (fs.is_open())
+			fs << "iter,nfJ,S,stepNorm,lambda,accepted,residualSeconds,jacobianSeconds,solveSeconds\n";
+	}
+
+	bool isOpened() const { return fs.is_open(); }
+
+	void onIteration(const LMIterationInfo &info)
+	{
+		if (!fs.is_open()) return;
+		fs << info.iter << ',' << info.nfJ << ',' << info.S << ',' << info.stepNorm << ',' << info.lambda << ','
+			<< int(info.accepted) << ',' << info.residualSeconds << ',' << info.jacobianSeconds << ','
+			<< info.solveSeconds << '\n';
+	}
+
+	//the iterations are the rows already written, the file is only flushed
+	void onFinish(int /*iterations*/)
+	{
+		if (fs.is_open()) fs << std::endl;
+	}
+
+private:
+	std::ofstream fs;
+};
+
 class LMSolverImpl : public LMSolver
 {
 public:
+	//the solver of the damped normal equations (A + lambda * diag(D)) * d = v,
+	//SOLVER_CHOLESKY falls back to LDL^T and then to SOLVER_EIG when A is not positive
+	//definite, SOLVER_QR factorizes the stacked [J; sqrt(lambda * D)] directly, which is
+	//more accurate for ill-conditioned J (it needs J, so the matrix-free callback uses
+	//SOLVER_CHOLESKY instead), SOLVER_EIG is the original eigendecomposition and the default
+	enum SolverType
+	{
+		SOLVER_CHOLESKY, SOLVER_QR, SOLVER_EIG
+	};
+
 	LMSolverImpl() : maxIters(100) { init(); }
 	LMSolverImpl(const Ptr<LMSolver::Callback>& _cb, int _maxIters) : cb(_cb), maxIters(_maxIters) { init(); }
 	LMSolverImpl(const Ptr<LMSolver::Callback>& _cb, int _maxIters, double _epsx, double _epsf, std::string _logFileName) :
 		cb(_cb), maxIters(_maxIters), epsx(_epsx), epsf(_epsf), logFileName(_logFileName)
 	{
 		printInterval = 0;
+		solverType = SOLVER_EIG;
+		_initTermination();
 	}
 
 	void init()
 	{
 		epsx = epsf = FLT_EPSILON;
 		printInterval = 0;
+		solverType = SOLVER_EIG;
+		_initTermination();
+	}
+
+	//stop when an accepted step decreases S by less than epsDecrease * S, or when
+	//norm(J^T * r, NORM_INF) falls below epsGradient times its initial value, 0 disables
+	void setTermination(double _epsDecrease, double _epsGradient)
+	{
+		epsDecrease = _epsDecrease;
+		epsGradient = _epsGradient;
+	}
+
+	//stop when S has not decreased by stallTolerance * S in stallIters iterations
+	//(the rejected steps count), stallIters = 0 disables
+	void setStallDetection(int _stallIters, double _stallTolerance)
+	{
+		stallIters = _stallIters;
+		stallTolerance = _stallTolerance;
 	}
 
+	//the budgets of the evaluations of the callback (nfJ) and of the wall-clock time, 0 disables
+	void setBudget(int _maxEvaluations, double _maxSeconds)
+	{
+		maxEvaluations = _maxEvaluations;
+		maxSeconds = _maxSeconds;
+	}
+
+	void setSolverType(SolverType type) { solverType = type; }
+	SolverType getSolverType() const { return solverType; }
+
+	//the telemetry is called once per iteration, an empty one disables the timing
+	void setTelemetry(const Ptr<LMTelemetry> &_telemetry) { telemetry = _telemetry; }
+
 	int run(InputOutputArray _param0) const
 	{
+		LMSummary summary;
+		return run(_param0, summary);
+	}
+
+	//the return value is the same as run, summary tells why it stopped
+	int run(InputOutputArray _param0, LMSummary &summary) const
+	{
+		summary = LMSummary();
+		summary.reason = LM_TERM_FAILED;
+		int64 startTick = maxSeconds > 0 ? getTickCount() : 0;
+
 		Mat param0 = _param0.getMat(), x, xd, r, rd, J, A, Ap, v, temp_d, d;
 		int ptype = param0.type();
 
@@ -56,13 +286,38 @@ public:
 		if (x.cols != 1)
 			transpose(x, x);
 
-		if (!cb->compute(x, r, J))
+		//the matrix-free callback never forms J and r
+		const LMSolver::NormalCallback *ncb = dynamic_cast<const LMSolver::NormalCallback *>(cb.get());
+		if (ncb != NULL && !ncb->isMatrixFree())
+			ncb = NULL;
+
+		//the ticks are only read with a telemetry
+		LMTelemetry *pTelemetry = telemetry.get();
+		LMIterationInfo info = LMIterationInfo();
+		int64 tick = pTelemetry != NULL ? getTickCount() : 0;
+
+		NormalEquation normal, trial;
+		if (!_evaluate(ncb, x, r, J, normal))
 			return -1;
-		double S = norm(r, NORM_L2SQR);
+		normal.getA(A);
+		normal.getV(v);
+		double S = normal.S;
 		int nfJ = 2;
+		summary.initialS = S;
+
+		double gradient0 = norm(v, NORM_INF);
+		double stallS = S;
+		int stallCount = 0;
 
-		mulTransposed(J, A, true);
-		gemm(J, r, 1, noArray(), 0, v, GEMM_1_T);
+		if (pTelemetry != NULL)
+		{
+			info.jacobianSeconds = _lap(tick);
+			info.nfJ = nfJ;
+			info.S = S;
+			info.lambda = 1;
+			info.accepted = true;
+			pTelemetry->onIteration(info);
+		}
 
 		Mat D = A.diag().clone();
 
@@ -78,29 +333,36 @@ public:
 		}
 
 		//printf("************************************************************************************\n");
-		std::ofstream fs(logFileName, std::ios::out);
+		std::ofstream fs;
+		if (!logFileName.empty())
+			fs.open(logFileName, std::ios::out);
 		bool isLog = fs.is_open();
 
 		if (isLog)
 		{
-			fs << iter << " " << norm(r) << std::endl;
+			fs << iter << " " << std::sqrt(S) << std::endl;
 		}
 
 		for (;; )
 		{
 			CV_Assert(A.type() == CV_64F && A.rows == lx);
+			if (pTelemetry != NULL)
+			{
+				info = LMIterationInfo();
+				tick = getTickCount();
+			}
+
 			A.copyTo(Ap);
 			for (i = 0; i < lx; i++)
 				Ap.at<double>(i, i) += lambda*D.at<double>(i);
-			solve(Ap, v, d, DECOMP_EIG);
+			_solve(Ap, v, J, r, lambda, D, d);
 			subtract(x, d, xd);
-			if (!cb->compute(xd, rd, noArray()))
-			{
-				rd = r.clone() * 10;
-			}
+			if (pTelemetry != NULL) info.solveSeconds += _lap(tick);
 
+			//a failed evaluation counts as the residual scaled by 10
+			double Sd = _evaluateCost(ncb, xd, rd, trial) ? trial.S : S * 100;
 			nfJ++;
-			double Sd = norm(rd, NORM_L2SQR);
+			if (pTelemetry != NULL) info.residualSeconds += _lap(tick);
 			gemm(A, d, -1, v, 2, temp_d);
 			double dS = d.dot(temp_d);
 			double R = (S - Sd) / (fabs(dS) > DBL_EPSILON ? dS : 1);
@@ -119,30 +381,75 @@ public:
 				nu = std::min(std::max(nu, 2.), 10.);
 				if (lambda == 0)
 				{
-					invert(A, Ap, DECOMP_EIG);
-					double maxval = DBL_EPSILON;
-					for (i = 0; i < lx; i++)
-						maxval = std::max(maxval, std::abs(Ap.at<double>(i, i)));
+					if (pTelemetry != NULL) tick = getTickCount();
+					double maxval = std::max(_maxInverseDiagonal(A), DBL_EPSILON);
 					lambda = lc = std::max(1. / maxval, 0.01);
 					//lambda = lc = 1./maxval;
 					nu *= 0.5;
+					if (pTelemetry != NULL) info.solveSeconds += _lap(tick);
 				}
 				lambda *= nu;
 			}
 
-			if (Sd < S)
+			bool accepted = Sd < S;
+			double Sprev = S;
+			if (accepted)
 			{
 				nfJ++;
 				S = Sd;
 				std::swap(x, xd);
-				if (!cb->compute(x, r, J))
+				if (pTelemetry != NULL) tick = getTickCount();
+				if (!_evaluate(ncb, x, r, J, normal))
 					return -1;
-				mulTransposed(J, A, true);
-				gemm(J, r, 1, noArray(), 0, v, GEMM_1_T);
+				normal.getA(A);
+				normal.getV(v);
+				if (pTelemetry != NULL) info.jacobianSeconds += _lap(tick);
 			}
 
 			iter++;
-			bool proceed = iter < maxIters && norm(d, NORM_INF) >= epsx && norm(r, NORM_INF) >= epsf;
+			double stepNorm = norm(d, NORM_INF);
+			LMTerminationReason reason = LM_TERM_NONE;
+			if (stepNorm < epsx)
+				reason = LM_TERM_SMALL_STEP;
+			else if (normal.maxAbsR < epsf)
+				reason = LM_TERM_SMALL_RESIDUAL;
+			else if (accepted && epsDecrease > 0 && Sprev - S < epsDecrease * Sprev)
+				reason = LM_TERM_SMALL_DECREASE;
+			else if (accepted && epsGradient > 0 && norm(v, NORM_INF) <= epsGradient * gradient0)
+				reason = LM_TERM_SMALL_GRADIENT;
+			else
+			{
+				if (S < stallS * (1 - stallTolerance))
+				{
+					stallS = S;
+					stallCount = 0;
+				}
+				else
+				{
+					stallCount++;
+				}
+
+				if (stallIters > 0 && stallCount >= stallIters)
+					reason = LM_TERM_STALL;
+				else if (iter >= maxIters)
+					reason = LM_TERM_MAX_ITERS;
+				else if (maxEvaluations > 0 && nfJ >= maxEvaluations)
+					reason = LM_TERM_MAX_EVALUATIONS;
+				else if (maxSeconds > 0 && (getTickCount() - startTick) / getTickFrequency() >= maxSeconds)
+					reason = LM_TERM_TIME_LIMIT;
+			}
+			bool proceed = reason == LM_TERM_NONE;
+
+			if (pTelemetry != NULL)
+			{
+				info.iter = iter;
+				info.nfJ = nfJ;
+				info.S = S;
+				info.stepNorm = stepNorm;
+				info.lambda = lambda;
+				info.accepted = accepted;
+				pTelemetry->onIteration(info);
+			}
 
 			/*printf("iter=%d    error=%f    params=", iter, norm(r));
 			for (size_t i = 0; i < x.rows; i++)
@@ -153,7 +460,7 @@ public:
 
 			if (isLog)
 			{
-				fs << iter << " " << norm(r) << std::endl;
+				fs << iter << " " << std::sqrt(normal.S) << std::endl;
 			}
 
 			if (printInterval != 0 && (iter % printInterval == 0 || iter == 1 || !proceed))
@@ -163,16 +470,24 @@ public:
 			}
 
 			if (!proceed)
+			{
+				summary.reason = reason;
 				break;
+			}
 		}
 
 		if (param0.size != x.size)
 			transpose(x, x);
 
 		x.convertTo(param0, ptype);
+		summary.iterations = iter;
+		summary.nfJ = nfJ;
+		summary.finalS = S;
 		if (iter == maxIters)
 			iter = -iter;
 
+		if (pTelemetry != NULL)
+			pTelemetry->onFinish(iter);
 		return iter;
 	}
 
@@ -185,6 +500,211 @@ public:
 	int maxIters;
 	int printInterval;
 	std::string logFileName;
+	SolverType solverType;
+	Ptr<LMTelemetry> telemetry;
+
+	double epsDecrease, epsGradient;
+	int stallIters;
+	double stallTolerance;
+	int maxEvaluations;
+	double maxSeconds;
+
+private:
+	void _initTermination()
+	{
+		epsDecrease = epsGradient = 0;
+		stallIters = 0;
+		stallTolerance = 0;
+		maxEvaluations = 0;
+		maxSeconds = 0;
+	}
+
+	//the seconds since tick, tick is moved to now
+	static double _lap(int64 &tick)
+	{
+		int64 now = getTickCount();
+		double seconds = (now - tick) / getTickFrequency();
+		tick = now;
+		return seconds;
+	}
+
+	//evaluate A, v and S at x, J and r are left empty by the matrix-free callback
+	bool _evaluate(const LMSolver::NormalCallback *ncb, const Mat &x, Mat &r, Mat &J, NormalEquation &normal) const
+	{
+		if (ncb != NULL)
+			return ncb->computeNormal(x, normal, true);
+
+		if (!cb->compute(x, r, J))
+			return false;
+		//form A, v and S in one pass over the rows of J
+		CV_Assert(J.type() == CV_64F && r.type() == CV_64F && r.isContinuous() && J.rows == r.rows);
+		normal.reset(J.cols);
+		normal.addRows(J.ptr<double>(), J.step1(), r.ptr<double>(), J.rows);
+		return true;
+	}
+
+	//evaluate S only
+	bool _evaluateCost(const LMSolver::NormalCallback *ncb, const Mat &x, Mat &r, NormalEquation &normal) const
+	{
+		if (ncb != NULL)
+			return ncb->computeNormal(x, normal, false);
+
+		if (!cb->compute(x, r, noArray()))
+			return false;
+		CV_Assert(r.type() == CV_64F && r.isContinuous());
+		normal.reset(x.rows);
+		normal.addResiduals(r.ptr<double>(), r.rows);
+		return true;
+	}
+
+	//the Cholesky factorization A = L * L^T in place (lower triangle),
+	//return false if A is not numerically positive definite
+	static bool _cholesky(Mat &L)
+	{
+		int n = L.rows;
+		double tol = 0;
+		for (int i = 0; i < n; i++) tol = std::max(tol, std::abs(L.at<double>(i, i)));
+		tol *= n * DBL_EPSILON;
+
+		for (int j = 0; j < n; j++)
+		{
+			double *lj = L.ptr<double>(j);
+			double s = lj[j];
+			for (int k = 0; k < j; k++) s -= lj[k] * lj[k];
+			if (!(s > tol)) return false;
+			lj[j] = std::sqrt(s);
+
+			for (int i = j + 1; i < n; i++)
+			{
+				double *li = L.ptr<double>(i);
+				s = li[j];
+				for (int k = 0; k < j; k++) s -= li[k] * lj[k];
+				li[j] = s / lj[j];
+			}
+		}
+		return true;
+	}
+
+	//the factorization A = L * diag(D) * L^T in place, L has the unit diagonal and
+	//D is stored on the diagonal, it also handles the indefinite but nonsingular A
+	static bool _ldlt(Mat &L)
+	{
+		int n = L.rows;
+		double tol = 0;
+		for (int i = 0; i < n; i++) tol = std::max(tol, std::abs(L.at<double>(i, i)));
+		tol *= n * DBL_EPSILON;
+
+		for (int j = 0; j < n; j++)
+		{
+			double *lj = L.ptr<double>(j);
+			double dj = lj[j];
+			for (int k = 0; k < j; k++) dj -= lj[k] * lj[k] * L.at<double>(k, k);
+			if (!(std::abs(dj) > tol)) return false;
+			lj[j] = dj;
+
+			for (int i = j + 1; i < n; i++)
+			{
+				double *li = L.ptr<double>(i);
+				double s = li[j];
+				for (int k = 0; k < j; k++) s -= li[k] * lj[k] * L.at<double>(k, k);
+				li[j] = s / dj;
+			}
+		}
+		return true;
+	}
+
+	//solve with the factor of _cholesky (unitDiag = false) or _ldlt (unitDiag = true)
+	static void _substitute(const Mat &L, bool unitDiag, const Mat &b, Mat &x)
+	{
+		int n = L.rows;
+		b.copyTo(x);
+		double *px = x.ptr<double>();
+		for (int i = 0; i < n; i++)
+		{
+			const double *li = L.ptr<double>(i);
+			double s = px[i];
+			for (int k = 0; k < i; k++) s -= li[k] * px[k];
+			px[i] = unitDiag ? s : s / li[i];
+		}
+		if (unitDiag)
+		{
+			for (int i = 0; i < n; i++) px[i] /= L.at<double>(i, i);
+		}
+		for (int i = n - 1; i >= 0; i--)
+		{
+			double s = px[i];
+			for (int k = i + 1; k < n; k++) s -= L.at<double>(k, i) * px[k];
+			px[i] = unitDiag ? s : s / L.at<double>(i, i);
+		}
+	}
+
+	//solve the symmetric system by Cholesky, then LDL^T, then the eigendecomposition
+	static void _solveSymmetric(const Mat &A, const Mat &b, Mat &x)
+	{
+		Mat L = A.clone();
+		if (_cholesky(L))
+		{
+			_substitute(L, false, b, x);
+			return;
+		}
+		A.copyTo(L);
+		if (_ldlt(L))
+		{
+			_substitute(L, true, b, x);
+			return;
+		}
+		solve(A, b, x, DECOMP_EIG);
+	}
+
+	void _solve(const Mat &Ap, const Mat &v, const Mat &J, const Mat &r, double lambda, const Mat &D, Mat &d) const
+	{
+		if (solverType == SOLVER_EIG)
+		{
+			solve(Ap, v, d, DECOMP_EIG);
+		}
+		else if (solverType == SOLVER_QR && !J.empty())
+		{
+			//the least squares of [J; sqrt(lambda * D)] * d = [r; 0]
+			int rows = J.rows, n = J.cols;
+			Mat Aug = Mat::zeros(rows + n, n, CV_64F), rhs = Mat::zeros(rows + n, 1, CV_64F);
+			J.copyTo(Aug.rowRange(0, rows));
+			r.copyTo(rhs.rowRange(0, rows));
+			for (int i = 0; i < n; i++)
+				Aug.at<double>(rows + i, i) = std::sqrt(lambda * std::max(D.at<double>(i), 0.0));
+			solve(Aug, rhs, d, DECOMP_QR);
+		}
+		else
+		{
+			_solveSymmetric(Ap, v, d);
+		}
+	}
+
+	//the largest diagonal entry of A^-1, used to reset lambda, SOLVER_EIG keeps the original invert
+	double _maxInverseDiagonal(const Mat &A) const
+	{
+		int n = A.rows;
+		Mat Ainv;
+		Mat L = A.clone();
+		if (solverType != SOLVER_EIG && _cholesky(L))
+		{
+			Mat e = Mat::zeros(n, 1, CV_64F), col;
+			double maxval = 0;
+			for (int i = 0; i < n; i++)
+			{
+				e.at<double>(i) = 1;
+				_substitute(L, false, e, col);
+				maxval = std::max(maxval, std::abs(col.at<double>(i)));
+				e.at<double>(i) = 0;
+			}
+			return maxval;
+		}
+
+		invert(A, Ainv, DECOMP_EIG);
+		double maxval = 0;
+		for (int i = 0; i < n; i++)
+			maxval = std::max(maxval, std::abs(Ainv.at<double>(i, i)));
+		return maxval;
+	}
 };
 
 Ptr<LMSolver> customCreateLMSolver(const Ptr<LMSolver::Callback>& cb, int maxIters, double _epsx, double _epsf, std::string _logFileName)
@@ -4,35 +4,69 @@
 #include <commonMacro.h>
 #include "../common/OpenCVLevMarq.h"
 #include "../common/ModelDataProducer.h"
+#include "../common/TrialRunner.h"
+#include "../common/SyntheticDataFactory.h"
 #include <random>
 #include <map>
 #include <sstream>
 #include <algorithm>
+#include <type_traits>
 
-inline void CalculateRotation(const std::shared_ptr<ModelDataProducer> &pModelData,
-					   const std::shared_ptr<CameraModel> &pModel,
-					   const std::shared_ptr<Rotation> &pRot)
+//The image points of the pairs in the structure-of-arrays layout. They are fixed
+//during the refinement, so they are converted once and can be shared by all the
+//refinements of the same data
+struct PairImagePoints
+{
+	PairImagePoints(const ModelDataProducer &modelData)
+	{
+		pts1.assign(modelData.mvImgPt1);
+		pts2.assign(modelData.mvImgPt2);
+	}
+
+	ImagePointArray pts1, pts2;
+};
+
+//map the image points of all the pairs to the sphere with the current model,
+//return false if any mapping is invalid
+inline bool MapPairsToSphere(const PairImagePoints &imgPts, const std::shared_ptr<CameraModel> &pModel,
+							 SpherePointArray &spherePts1, SpherePointArray &spherePts2)
 {
-	assert(pModelData.use_count() != 0 && pModel.use_count() != 0 && pRot.use_count() != 0);
+	const ImagePointArray &imgPts1 = imgPts.pts1, &imgPts2 = imgPts.pts2;
+	int num = int(imgPts1.size());
+	spherePts1.resize(num);
+	spherePts2.resize(num);
+
+	//the mapping is instantiated for the concrete model type
+	bool valid = true;
+	visitCameraModel(*pModel, [&](auto &model)
+	{
+		valid &= model.mapI2SBatch(imgPts1.x.data(), imgPts1.y.data(), num,
+								   spherePts1.x.data(), spherePts1.y.data(), spherePts1.z.data(), spherePts1.mask.data());
+		valid &= model.mapI2SBatch(imgPts2.x.data(), imgPts2.y.data(), num,
+								   spherePts2.x.data(), spherePts2.y.data(), spherePts2.z.data(), spherePts2.mask.data());
+	});
+	return valid;
+}
 
+//the least squares rotation R * s1 = s2 of the pairs with pMask[i] != 0 (all if pMask is NULL)
+inline cv::Mat FitRotation(const SpherePointArray &spherePts1, const SpherePointArray &spherePts2, const uchar *pMask = NULL)
+{
 	double s[9] = { 0 };
 	cv::Mat S(3, 3, CV_64FC1, s);
-	for (size_t i = 0; i < pModelData->mcount; i++)
+	const double *X1 = spherePts1.x.data(), *Y1 = spherePts1.y.data(), *Z1 = spherePts1.z.data();
+	const double *X2 = spherePts2.x.data(), *Y2 = spherePts2.y.data(), *Z2 = spherePts2.z.data();
+	for (size_t i = 0; i < spherePts1.size(); i++)
 	{
-		cv::Point2d &imgPt1 = pModelData->mvImgPt1[i], &imgPt2 = pModelData->mvImgPt2[i];
-		cv::Point3d spherePt1, spherePt2;
-		pModel->mapI2S(imgPt1, spherePt1);
-		pModel->mapI2S(imgPt2, spherePt2);
-
-		s[0] += (spherePt1.x * spherePt2.x);
-		s[1] += (spherePt1.x * spherePt2.y);
-		s[2] += (spherePt1.x * spherePt2.z);
-		s[3] += (spherePt1.y * spherePt2.x);
-		s[4] += (spherePt1.y * spherePt2.y);
-		s[5] += (spherePt1.y * spherePt2.z);
-		s[6] += (spherePt1.z * spherePt2.x);
-		s[7] += (spherePt1.z * spherePt2.y);
-		s[8] += (spherePt1.z * spherePt2.z);
+		if (pMask != NULL && pMask[i] == 0) continue;
+		s[0] += (X1[i] * X2[i]);
+		s[1] += (X1[i] * Y2[i]);
+		s[2] += (X1[i] * Z2[i]);
+		s[3] += (Y1[i] * X2[i]);
+		s[4] += (Y1[i] * Y2[i]);
+		s[5] += (Y1[i] * Z2[i]);
+		s[6] += (Z1[i] * X2[i]);
+		s[7] += (Z1[i] * Y2[i]);
+		s[8] += (Z1[i] * Z2[i]);
 	}
 
 	cv::Mat w, u, vt;
@@ -40,22 +74,178 @@ inline void CalculateRotation(const std::shared_ptr<ModelDataProducer> &pModelDa
 	cv::Mat I = cv::Mat::eye(3, 3, CV_64FC1);
 	I.at<double>(2, 2) = cv::determinant(vt.t() * u.t());
 	cv::Mat R = vt.t() * I * u.t();
-	pRot->updataRotation(R);
+	return R;
+}
+
+inline void CalculateRotation(const PairImagePoints &imgPts,
+					   const std::shared_ptr<CameraModel> &pModel,
+					   const std::shared_ptr<Rotation> &pRot)
+{
+	assert(pModel.use_count() != 0 && pRot.use_count() != 0);
+
+	SpherePointArray spherePts1, spherePts2;
+	MapPairsToSphere(imgPts, pModel, spherePts1, spherePts2);
+	pRot->updataRotation(FitRotation(spherePts1, spherePts2));
+}
+
+inline void CalculateRotation(const std::shared_ptr<ModelDataProducer> &pModelData,
+					   const std::shared_ptr<CameraModel> &pModel,
+					   const std::shared_ptr<Rotation> &pRot)
+{
+	assert(pModelData.use_count() != 0);
+	CalculateRotation(PairImagePoints(*pModelData), pModel, pRot);
+}
+
+//the rotation R * a1 = a2, R * b1 = b2 of the 2 pairs of unit vectors, the frame of each
+//side is built on the bisector of a and b so the error is shared by the 2 pairs,
+//return false if a and b are nearly parallel
+inline bool RotationFromTwoPairs(const cv::Vec3d &a1, const cv::Vec3d &b1,
+								 const cv::Vec3d &a2, const cv::Vec3d &b2, cv::Matx33d &R)
+{
+	cv::Vec3d t1 = a1 + b1, m1 = a1.cross(b1), t2 = a2 + b2, m2 = a2.cross(b2);
+	double lt1 = cv::norm(t1), lm1 = cv::norm(m1), lt2 = cv::norm(t2), lm2 = cv::norm(m2);
+	if (lm1 < 1e-6 || lm2 < 1e-6 || lt1 < 1e-6 || lt2 < 1e-6) return false;
+	t1 = t1 * (1 / lt1); m1 = m1 * (1 / lm1);
+	t2 = t2 * (1 / lt2); m2 = m2 * (1 / lm2);
+	cv::Vec3d n1 = t1.cross(m1), n2 = t2.cross(m2);
+
+	//R = [t2 m2 n2] * [t1 m1 n1]^T
+	for (int r = 0; r < 3; r++)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			R(r, c) = t2[r] * t1[c] + m2[r] * m1[c] + n2[r] * n1[c];
+		}
+	}
+	return true;
 }
 
-class FishModelRefineCallback : public cv::LMSolver::Callback
+//RANSAC around CalculateRotation, the hypotheses are the rotations of the minimal samples
+//of 2 pairs and a pair is an inlier if |R * s1 - s2| < threshold. The iteration number
+//adapts to the inlier ratio (with the confidence 0.99) up to maxIterations, and the
+//rotation is refitted on the inliers of the best hypothesis. Return the inlier number
+inline int CalculateRotationRansac(const PairImagePoints &imgPts,
+								   const std::shared_ptr<CameraModel> &pModel,
+								   const std::shared_ptr<Rotation> &pRot,
+								   double threshold, int maxIterations, RandomStream &rng,
+								   std::vector<uchar> *pInlierMask = NULL)
+{
+	assert(pModel.use_count() != 0 && pRot.use_count() != 0);
+	assert(threshold > 0 && maxIterations > 0);
+
+	SpherePointArray spherePts1, spherePts2;
+	MapPairsToSphere(imgPts, pModel, spherePts1, spherePts2);
+	int num = int(spherePts1.size());
+	const double *X1 = spherePts1.x.data(), *Y1 = spherePts1.y.data(), *Z1 = spherePts1.z.data();
+	const double *X2 = spherePts2.x.data(), *Y2 = spherePts2.y.data(), *Z2 = spherePts2.z.data();
+
+	//the pairs with an invalid mapping never take part
+	std::vector<uchar> vValid(num), vInlier(num), vBestInlier;
+	for (int i = 0; i < num; i++)
+	{
+		vValid[i] = spherePts1.mask[i] != 0 && spherePts2.mask[i] != 0;
+	}
+
+	double threshold2 = threshold * threshold;
+	int bestNum = 0, iterations = maxIterations;
+	for (int iter = 0; iter < iterations && num >= 2; iter++)
+	{
+		int a = rng.uniformInt(0, num), b = rng.uniformInt(0, num - 1);
+		if (b >= a) b++;
+		if (!vValid[a] || !vValid[b]) continue;
+
+		cv::Matx33d R;
+		if (!RotationFromTwoPairs(cv::Vec3d(X1[a], Y1[a], Z1[a]), cv::Vec3d(X1[b], Y1[b], Z1[b]),
+								  cv::Vec3d(X2[a], Y2[a], Z2[a]), cv::Vec3d(X2[b], Y2[b], Z2[b]), R))
+			continue;
+
+		const double *r = R.val;
+		int inlierNum = 0;
+		for (int i = 0; i < num; i++)
+		{
+			double ex = r[0] * X1[i] + r[1] * Y1[i] + r[2] * Z1[i] - X2[i];
+			double ey = r[3] * X1[i] + r[4] * Y1[i] + r[5] * Z1[i] - Y2[i];
+			double ez = r[6] * X1[i] + r[7] * Y1[i] + r[8] * Z1[i] - Z2[i];
+			vInlier[i] = vValid[i] && ex * ex + ey * ey + ez * ez < threshold2;
+			inlierNum += vInlier[i];
+		}
+
+		if (inlierNum > bestNum)
+		{
+			bestNum = inlierNum;
+			vBestInlier.swap(vInlier);
+			vInlier.resize(num);
+
+			//the probability that a sample of 2 pairs has an outlier
+			double ratio = double(bestNum) / num;
+			double outlierProb = 1 - ratio * ratio;
+			if (outlierProb <= DBL_EPSILON)
+			{
+				iterations = iter + 1;
+			}
+			else
+			{
+				double needed = log(1 - 0.99) / log(outlierProb);
+				iterations = int(std::min(double(maxIterations), std::ceil(needed)));
+			}
+		}
+	}
+
+	if (bestNum < 2)
+	{
+		std::cout << "Warning: RANSAC found no rotation in CalculateRotationRansac, all the pairs are used" << std::endl;
+		vBestInlier = vValid;
+		bestNum = 0;
+		for (int i = 0; i < num; i++) bestNum += vBestInlier[i];
+	}
+
+	pRot->updataRotation(FitRotation(spherePts1, spherePts2, vBestInlier.data()));
+	if (pInlierMask != NULL) pInlierMask->swap(vBestInlier);
+	return bestNum;
+}
+
+class FishModelRefineCallback : public cv::LMSolver::NormalCallback
 {
 public:
+	//ANALYTIC_JACOBIAN computes the closed-form Jacobian in the same pass as the residual,
+	//NUMERIC_JACOBIAN uses the central differences and is kept for verification
+	enum JacobianMode
+	{
+		ANALYTIC_JACOBIAN, NUMERIC_JACOBIAN
+	};
+
+	//the loss of the squared sphere residual norm s, the scale c is the residual where
+	//the outlier handling starts: HUBER is linear beyond c, CAUCHY is c^2 * log(1 + s / c^2),
+	//TUKEY (biweight) ignores the pairs beyond c completely
+	enum LossType
+	{
+		LOSS_SQUARED, LOSS_HUBER, LOSS_CAUCHY, LOSS_TUKEY
+	};
+
+	//RESIDUAL_CHORD is the 3 rows R * s1 - s2 of every pair, RESIDUAL_TANGENT is the
+	//2 rows of R * s1 in the tangent plane of s2 (about the angle between them), one row
+	//for each degree of freedom of the pair, so J and J^T * J are built from a third fewer rows
+	enum ResidualType
+	{
+		RESIDUAL_CHORD, RESIDUAL_TANGENT
+	};
+
+	//pImgPts are the converted image points of pModelData shared with other callbacks,
+	//they are converted here if it is empty
 	FishModelRefineCallback(const std::shared_ptr<ModelDataProducer> &pModelData,
 							const std::shared_ptr<CameraModel> &pModel,
 							const std::shared_ptr<Rotation> &pRot,
-							const std::vector<uchar> &vMask)
+							const std::vector<uchar> &vMask,
+							const std::shared_ptr<const PairImagePoints> &pImgPts = nullptr)
 	{
 		assert(pModel.use_count() != 0 && pModel.use_count() != 0 && pRot.use_count() != 0);
 		mpModelData = pModelData;
 		mpModel = pModel;
 		mpRot = pRot;
 
+		mpImgPts = pImgPts ? pImgPts : std::make_shared<const PairImagePoints>(*mpModelData);
+		assert(int(mpImgPts->pts1.size()) == mpModelData->mcount);
+
 		assert(vMask.size() == pModel->vpParameter.size());
 
 		for (size_t i = 0; i < vMask.size(); i++)
@@ -64,6 +254,7 @@ public:
 			{
 				mvpParameter.push_back(pModel->vpParameter[i]);
 				mvRotMask.push_back(false);
+				mvParamIndex.push_back(i);
 			}
 		}
 
@@ -71,32 +262,96 @@ public:
 		{
 			mvpParameter.push_back(&(mpRot->axisAngle[i]));
 			mvRotMask.push_back(true);
+			mvParamIndex.push_back(i);
 		}
+
+		//the defaults are the numeric Jacobian and the serial dense J of the original
+		//callback, the faster paths are chosen by setJacobianMode, setParallel and setMatrixFree
+		mJacobianMode = NUMERIC_JACOBIAN;
+		mbParallel = false;
+		mbMatrixFree = false;
+		mBlockSize = 512;
+		mLossType = LOSS_SQUARED;
+		mLossScale = 1;
+		mResidualType = RESIDUAL_CHORD;
+		mbMappingCache = true;
+		mbMappedDeriv = false;
 	}
 
+	void setJacobianMode(JacobianMode mode) { mJacobianMode = mode; }
+	JacobianMode getJacobianMode() const { return mJacobianMode; }
+
+	//evaluate the pairs in blocks of blockSize pairs with cv::parallel_for_,
+	//the result does not depend on the block size or the number of threads
+	void setParallel(bool parallel, int blockSize = 512)
+	{
+		assert(blockSize > 0);
+		mbParallel = parallel;
+		mBlockSize = blockSize;
+		//the cached derivatives are laid out per block
+		mvMappedIntrinsic.clear();
+	}
+
+	//The sphere points (and their derivatives) of the last evaluation are reused while the
+	//intrinsic parameters do not change, so the rotation columns of the numeric Jacobian
+	//and the refinement of the rotation only skip all the inverse projections
+	void setMappingCache(bool enable)
+	{
+		mbMappingCache = enable;
+		mvMappedIntrinsic.clear();
+	}
+
+	void setResidualType(ResidualType type) { mResidualType = type; }
+	ResidualType getResidualType() const { return mResidualType; }
+
+	//the residual rows of every pair
+	int getRowsPerPair() const { return mResidualType == RESIDUAL_TANGENT ? 2 : 3; }
+
+	//The robust loss is minimized by the iteratively reweighted least squares, the
+	//weights are recomputed at every evaluation. The matrix-free mode reports sum(rho)
+	//as the cost, compute() can only return the weighted residual, so LMSolverImpl sees
+	//the IRLS cost of the current weights there
+	void setLoss(LossType type, double scale = 1)
+	{
+		assert(scale > 0);
+		mLossType = type;
+		mLossScale = scale;
+	}
+	LossType getLossType() const { return mLossType; }
+
+	//the matrix-free mode hands only J^T * J, J^T * r and S to LMSolverImpl, it is
+	//used with the analytic Jacobian, the numeric one needs the full residual columns
+	void setMatrixFree(bool matrixFree) { mbMatrixFree = matrixFree; }
+	bool isMatrixFree() const { return mbMatrixFree && mJacobianMode == ANALYTIC_JACOBIAN; }
+
 	bool compute(cv::InputArray _param, cv::OutputArray _err, cv::OutputArray _Jac) const
 	{
 		cv::Mat param = _param.getMat();
-
-		for (size_t i = 0; i < mvpParameter.size(); i++)
-		{
-			*(mvpParameter[i]) = param.at<double>(i, 0);
-		}
+		_setParameters(param);
 
 		int pairNum = mpModelData->mcount;
-		//err.create(pairNum * 3, 1, CV_64F);
+		int rowNum = pairNum * getRowsPerPair();
 
-		_err.create(pairNum * 3, 1, CV_64F);
+		_err.create(rowNum, 1, CV_64F);
 		cv::Mat err = _err.getMat();
-		if (!_calcError(err))return false;
-
-		cv::Mat err2 = _err.getMat();
 
 		if (_Jac.needed())
 		{
-			_Jac.create(pairNum * 3, mvpParameter.size(), CV_64F);
+			_Jac.create(rowNum, mvpParameter.size(), CV_64F);
 			cv::Mat J = _Jac.getMat();
-			if (!_calcJacobian(J))return false;
+			if (mJacobianMode == ANALYTIC_JACOBIAN)
+			{
+				if (!_calcErrorAndJacobian(err, J))return false;
+			}
+			else
+			{
+				if (!_calcError(err))return false;
+				if (!_calcJacobian(J))return false;
+			}
+		}
+		else
+		{
+			if (!_calcError(err))return false;
 		}
 
 		/*std::cout << "average error = " << norm(err) << std::endl;
@@ -106,7 +361,119 @@ public:
 		return true;
 	}
 
+	//The pairs are split into at most NORMAL_STRIPE_NUM stripes of consecutive blocks,
+	//every stripe reduces its blocks into its own NormalEquation with its own scratch
+	//and the stripes are summed in order, so the result does not depend on the number
+	//of threads and the memory is O(stripeNum * blockSize * paramNum) for any pairNum
+	bool computeNormal(cv::InputArray _param, cv::NormalEquation &normal, bool needJacobian) const
+	{
+		cv::Mat param = _param.getMat();
+		_setParameters(param);
+
+		int pairNum = mpModelData->mcount;
+		int paramNum = int(mvpParameter.size());
+		int blockNum = (pairNum + mBlockSize - 1) / mBlockSize;
+		int stripeNum = std::max(std::min(blockNum, int(NORMAL_STRIPE_NUM)), 1);
+
+		double dR[27];
+		if (needJacobian) _calcRotationDerivative(dR);
+
+		//with the rotation only the sphere points never change, so they are mapped once
+		//for all the pairs and the stripes read them instead of their own scratch
+		bool useCache = mbMappingCache && _isRotationOnly();
+		if (useCache && !_isMappingCached(false))
+		{
+			bool valid = MapPairsToSphere(*mpImgPts, mpModel, mSpherePts1, mSpherePts2);
+			_storeMapping(false, valid);
+			if (!valid)return false;
+		}
+
+		//the scratch is only reallocated when the block size or the parameters change
+		mvStripe.resize(stripeNum);
+		for (int s = 0; s < stripeNum; s++)
+		{
+			NormalStripe &stripe = mvStripe[s];
+			stripe.spherePts1.resize(mBlockSize);
+			stripe.spherePts2.resize(mBlockSize);
+			stripe.spherePts1.jac.resize(mpModel->vpParameter.size() * 3 * mBlockSize);
+			stripe.spherePts2.jac.resize(mpModel->vpParameter.size() * 3 * mBlockSize);
+			stripe.err.resize(3 * mBlockSize);
+			stripe.jac.resize(size_t(3) * mBlockSize * paramNum);
+			//the scratch is sized for the 3 rows, which also covers the tangent residual
+			stripe.normal.reset(paramNum);
+			stripe.valid = 1;
+		}
+
+		visitCameraModel(*mpModel, [&](auto &model)
+		{
+			StripeEvaluator<typename std::remove_reference<decltype(model)>::type> evaluator(
+				this, model, mpRot->R.val, dR, stripeNum, needJacobian, useCache);
+			if (mbParallel && stripeNum > 1)
+			{
+				cv::parallel_for_(cv::Range(0, stripeNum), evaluator);
+			}
+			else
+			{
+				evaluator(cv::Range(0, stripeNum));
+			}
+		});
+
+		normal.reset(paramNum);
+		for (int s = 0; s < stripeNum; s++)
+		{
+			if (mvStripe[s].valid == 0)return false;
+			normal.add(mvStripe[s].normal);
+		}
+		return true;
+	}
+
+	//compare the analytic Jacobian with the central differences at param,
+	//return the maximum absolute difference of all the entries
+	double verifyJacobian(cv::InputArray _param) const
+	{
+		cv::Mat param = _param.getMat();
+		_setParameters(param);
+
+		int pairNum = mpModelData->mcount;
+		int rowNum = pairNum * getRowsPerPair();
+		cv::Mat err(rowNum, 1, CV_64F);
+		cv::Mat analyticJ(rowNum, int(mvpParameter.size()), CV_64F);
+		cv::Mat numericJ(rowNum, int(mvpParameter.size()), CV_64F);
+
+		if (!_calcErrorAndJacobian(err, analyticJ) || !_calcJacobian(numericJ))
+			return -1;
+		return cv::norm(analyticJ, numericJ, cv::NORM_INF);
+	}
+
 private:
+	void _setParameters(const cv::Mat &param) const
+	{
+		for (size_t i = 0; i < mvpParameter.size(); i++)
+		{
+			*(mvpParameter[i]) = param.at<double>(i, 0);
+		}
+
+		//keep the rotation matrix, fov and the cache of the model consistent with the new
+		//parameters, this is done before the parallel evaluation. The fov and the cache
+		//(which may build the inverse table) are only rebuilt if an intrinsic one changed
+		mpRot->updataRotation(mpRot->axisAngle);
+		bool changed = mvUpdatedIntrinsic.size() != mpModel->vpParameter.size();
+		for (size_t i = 0; i < mvUpdatedIntrinsic.size() && !changed; i++)
+		{
+			changed = *(mpModel->vpParameter[i]) != mvUpdatedIntrinsic[i];
+		}
+		if (changed)
+		{
+			mpModel->updateFov();
+			mpModel->updateCache();
+			mvUpdatedIntrinsic.resize(mpModel->vpParameter.size());
+			for (size_t i = 0; i < mvUpdatedIntrinsic.size(); i++)
+			{
+				mvUpdatedIntrinsic[i] = *(mpModel->vpParameter[i]);
+			}
+		}
+	}
+
 	void _calcDeriv(const cv::Mat &err1, const cv::Mat &err2, double h, cv::Mat &res) const
 	{
 		for (int i = 0; i < err1.rows; ++i)
@@ -114,32 +481,462 @@ private:
 	}
 
 	bool _calcError(cv::Mat &err) const
+	{
+		return _evaluate(err, NULL);
+	}
+
+	//residual e = R * s1 - s2 and its closed-form derivatives in one pass,
+	//de/d(intrinsic) = R * ds1/d(intrinsic) - ds2/d(intrinsic)
+	//de/d(axisAngle) = dR/d(axisAngle) * s1
+	bool _calcErrorAndJacobian(cv::Mat &err, cv::Mat &jac) const
+	{
+		return _evaluate(err, &jac);
+	}
+
+	void _calcRotationDerivative(double dR[27]) const
+	{
+		cv::Matx33d matdR[3];
+		mpRot->computeDerivative(matdR);
+		for (int k = 0; k < 3; k++)
+		{
+			std::copy(matdR[k].val, matdR[k].val + 9, dR + k * 9);
+		}
+	}
+
+	//Evaluate the pairs block by block, the blocks run in parallel when enabled.
+	//The camera model and the rotation are only read inside the parallel region
+	//(the numeric Jacobian perturbs them outside of it), and every block writes
+	//its own rows, so the result is identical to the serial evaluation.
+	//Model is the concrete model type given by visitCameraModel
+	template<class Model>
+	class BlockEvaluator : public cv::ParallelLoopBody
+	{
+	public:
+		BlockEvaluator(const FishModelRefineCallback *pCallback, Model &model, const double *pR, const double *pdR,
+					   double *pErr, cv::Mat *pJac, bool remap) :
+			mpCallback(pCallback), mModel(model), mpR(pR), mpdR(pdR), mpErr(pErr), mpJac(pJac), mbRemap(remap) {}
+
+		void operator()(const cv::Range &range) const
+		{
+			int pairNum = mpCallback->mpModelData->mcount;
+			for (int b = range.start; b < range.end; b++)
+			{
+				int start = b * mpCallback->mBlockSize;
+				int end = std::min(start + mpCallback->mBlockSize, pairNum);
+				int rows = mpCallback->getRowsPerPair();
+				double *pJac = mpJac == NULL ? NULL : mpJac->ptr<double>(rows * start);
+				bool valid = mpCallback->_evalBlock(mModel, start, end, mpR, mpdR, mpCallback->mSpherePts1,
+													mpCallback->mSpherePts2, start, mpErr + rows * start, pJac,
+													NULL, mbRemap);
+				mpCallback->mvBlockValid[b] = valid ? 1 : 0;
+			}
+		}
+
+	private:
+		const FishModelRefineCallback *mpCallback;
+		Model &mModel;
+		const double *mpR, *mpdR;
+		double *mpErr;
+		cv::Mat *mpJac;
+		bool mbRemap;
+	};
+
+	//the matrix-free counterpart of BlockEvaluator, see computeNormal
+	template<class Model>
+	class StripeEvaluator : public cv::ParallelLoopBody
+	{
+	public:
+		StripeEvaluator(const FishModelRefineCallback *pCallback, Model &model, const double *pR, const double *pdR,
+						int stripeNum, bool needJacobian, bool useCache) :
+			mpCallback(pCallback), mModel(model), mpR(pR), mpdR(pdR), mStripeNum(stripeNum),
+			mbNeedJacobian(needJacobian), mbUseCache(useCache) {}
+
+		void operator()(const cv::Range &range) const
+		{
+			for (int s = range.start; s < range.end; s++)
+			{
+				mpCallback->_evalStripe(mModel, s, mStripeNum, mpR, mpdR, mbNeedJacobian, mbUseCache);
+			}
+		}
+
+	private:
+		const FishModelRefineCallback *mpCallback;
+		Model &mModel;
+		const double *mpR, *mpdR;
+		int mStripeNum;
+		bool mbNeedJacobian, mbUseCache;
+	};
+
+	bool _evaluate(cv::Mat &err, cv::Mat *pJac) const
 	{
 		int pairNum = mpModelData->mcount;
-		//err.create(pairNum * 3, 1, CV_64F);
-		err.setTo(0);
+		int rowNum = pairNum * getRowsPerPair();
+		CV_Assert(err.isContinuous() && err.rows == rowNum);
+
+		//R is updated by _setParameters, dR[k] is d(R)/d(axisAngle[k]) in row-major order
+		const double *R = mpRot->R.val;
+		double dR[27];
+		if (pJac != NULL)
+		{
+			CV_Assert(pJac->isContinuous() && pJac->rows == rowNum && pJac->cols == int(mvpParameter.size()));
+			_calcRotationDerivative(dR);
+		}
+
+		//the scratch is resized here, outside of the parallel region,
+		//it is not touched if the cached sphere points are still valid
+		bool remap = !_isMappingCached(pJac != NULL);
+		if (remap)
+		{
+			mSpherePts1.resize(pairNum);
+			mSpherePts2.resize(pairNum);
+			if (pJac != NULL)
+			{
+				mSpherePts1.jac.resize(mpModel->vpParameter.size() * 3 * pairNum);
+				mSpherePts2.jac.resize(mpModel->vpParameter.size() * 3 * pairNum);
+			}
+		}
+
+		int blockNum = (pairNum + mBlockSize - 1) / mBlockSize;
+		mvBlockValid.assign(blockNum, 0);
+
+		visitCameraModel(*mpModel, [&](auto &model)
+		{
+			BlockEvaluator<typename std::remove_reference<decltype(model)>::type> evaluator(
+				this, model, R, dR, err.ptr<double>(), pJac, remap);
+			if (mbParallel && blockNum > 1)
+			{
+				cv::parallel_for_(cv::Range(0, blockNum), evaluator);
+			}
+			else
+			{
+				evaluator(cv::Range(0, blockNum));
+			}
+		});
+
 		bool valid = true;
+		for (int b = 0; b < blockNum; b++)
+		{
+			if (mvBlockValid[b] == 0) valid = false;
+		}
+		if (remap) _storeMapping(pJac != NULL, valid);
+		return valid;
+	}
+
+	//true if no intrinsic parameter is refined
+	bool _isRotationOnly() const
+	{
+		for (size_t k = 0; k < mvRotMask.size(); k++)
+		{
+			if (!mvRotMask[k])return false;
+		}
+		return true;
+	}
+
+	//true if mSpherePts1/2 hold the mapping (with the derivatives if needDeriv)
+	//of the current intrinsic parameters
+	bool _isMappingCached(bool needDeriv) const
+	{
+		if (!mbMappingCache || mvMappedIntrinsic.empty() || (needDeriv && !mbMappedDeriv))return false;
+		for (size_t i = 0; i < mvMappedIntrinsic.size(); i++)
+		{
+			if (*(mpModel->vpParameter[i]) != mvMappedIntrinsic[i])return false;
+		}
+		return true;
+	}
+
+	void _storeMapping(bool deriv, bool valid) const
+	{
+		mvMappedIntrinsic.clear();
+		if (!valid || !mbMappingCache)return;
+		for (size_t i = 0; i < mpModel->vpParameter.size(); i++)
+		{
+			mvMappedIntrinsic.push_back(*(mpModel->vpParameter[i]));
+		}
+		mbMappedDeriv = deriv;
+	}
+
+	//evaluate the stripe s of stripeNum into its NormalEquation
+	template<class Model>
+	void _evalStripe(Model &model, int s, int stripeNum, const double *pR, const double *pdR, bool needJacobian,
+					 bool useCache) const
+	{
+		NormalStripe &stripe = mvStripe[s];
+		int pairNum = mpModelData->mcount;
+		int paramNum = int(mvpParameter.size());
+		int blockNum = (pairNum + mBlockSize - 1) / mBlockSize;
+		int blockStart = int(int64_t(blockNum) * s / stripeNum), blockEnd = int(int64_t(blockNum) * (s + 1) / stripeNum);
 
-		for (size_t i = 0, idx = 0; i < pairNum; i++, idx += 3)
+		double *pErr = stripe.err.data();
+		double *pJac = needJacobian ? stripe.jac.data() : NULL;
+		double cost = 0;
+		for (int b = blockStart; b < blockEnd; b++)
 		{
-			cv::Point2d &imgPt1 = mpModelData->mvImgPt1[i], &imgPt2 = mpModelData->mvImgPt2[i];
-			//cv::Point3d &spherePt1 = mpModelData->mvSpherePt1[i], &spherePt2 = mpModelData->mvSpherePt2[i];
-			cv::Point3d spherePt1, spherePt2;
+			int start = b * mBlockSize;
+			int end = std::min(start + mBlockSize, pairNum);
+			bool valid = useCache ?
+				_evalBlock(model, start, end, pR, pdR, mSpherePts1, mSpherePts2, start, pErr, pJac, &cost, false) :
+				_evalBlock(model, start, end, pR, pdR, stripe.spherePts1, stripe.spherePts2, 0, pErr, pJac, &cost);
+			if (!valid)
+			{
+				stripe.valid = 0;
+				return;
+			}
+
+			int rowNum = getRowsPerPair() * (end - start);
+			if (needJacobian)
+				stripe.normal.addRows(pJac, paramNum, pErr, rowNum);
+			else
+				stripe.normal.addResiduals(pErr, rowNum);
+		}
+
+		//with the robust loss S is sum(rho), not the squared norm of the weighted rows
+		if (mLossType != LOSS_SQUARED) stripe.normal.S = cost;
+	}
 
-			valid &= mpModel->mapI2S(imgPt1, spherePt1);
-			valid &= mpModel->mapI2S(imgPt2, spherePt2);
+	//evaluate the residual rows (and the Jacobian rows if pJac is not NULL) of the pairs [start, end),
+	//the sphere points are written to spherePts1/2 from offset, pErr and pJac point to the rows of start.
+	//The rows are weighted by the robust loss, and pCost adds its sum(rho) if it is not NULL.
+	//The sphere points (and the derivatives) already in spherePts1/2 are used if remap is false
+	template<class Model>
+	bool _evalBlock(Model &model, int start, int end, const double *pR, const double *pdR,
+					SpherePointArray &spherePts1, SpherePointArray &spherePts2, int offset, double *pErr, double *pJac,
+					double *pCost = NULL, bool remap = true) const
+	{
+		int num = end - start;
+		double *X1 = spherePts1.x.data() + offset, *Y1 = spherePts1.y.data() + offset, *Z1 = spherePts1.z.data() + offset;
+		double *X2 = spherePts2.x.data() + offset, *Y2 = spherePts2.y.data() + offset, *Z2 = spherePts2.z.data() + offset;
+		uchar *M1 = spherePts1.mask.data() + offset, *M2 = spherePts2.mask.data() + offset;
+		const double *x1 = mpImgPts->pts1.x.data() + start, *y1 = mpImgPts->pts1.y.data() + start;
+		const double *x2 = mpImgPts->pts2.x.data() + start, *y2 = mpImgPts->pts2.y.data() + start;
 
+		//the mask is not needed since any invalid mapping will stop the evaluation
+		bool valid = true;
+		bool tangent = mResidualType == RESIDUAL_TANGENT;
+		int rows = getRowsPerPair();
+		if (pJac == NULL)
+		{
+			if (remap)
+			{
+				valid &= model.mapI2SBatch(x1, y1, num, X1, Y1, Z1, M1);
+				valid &= model.mapI2SBatch(x2, y2, num, X2, Y2, Z2, M2);
+				if (!valid)return false;
+			}
+
+			for (int i = 0; i < num; i++)
+			{
+				double *e = pErr + rows * i;
+				double q[3] = { pR[0] * X1[i] + pR[1] * Y1[i] + pR[2] * Z1[i],
+								pR[3] * X1[i] + pR[4] * Y1[i] + pR[5] * Z1[i],
+								pR[6] * X1[i] + pR[7] * Y1[i] + pR[8] * Z1[i] };
+				if (tangent)
+				{
+					double s2[3] = { X2[i], Y2[i], Z2[i] }, b1[3], b2[3];
+					_tangentBasis(s2, b1, b2);
+					e[0] = b1[0] * q[0] + b1[1] * q[1] + b1[2] * q[2];
+					e[1] = b2[0] * q[0] + b2[1] * q[1] + b2[2] * q[2];
+				}
+				else
+				{
+					e[0] = q[0] - X2[i];
+					e[1] = q[1] - Y2[i];
+					e[2] = q[2] - Z2[i];
+				}
+			}
+			if (mLossType != LOSS_SQUARED) _weightRows(num, pErr, NULL, pCost);
+			return true;
+		}
+
+		//the derivatives of the block are stored contiguously in the block-local layout
+		//J[(p * 3 + c) * num + i], see SpherePointArray
+		//the cached mapping of the rotation only has no derivatives
+		double *J1 = NULL, *J2 = NULL;
+		if (!spherePts1.jac.empty())
+		{
+			size_t jacOffset = model.vpParameter.size() * 3 * offset;
+			J1 = spherePts1.jac.data() + jacOffset;
+			J2 = spherePts2.jac.data() + jacOffset;
+		}
+		if (remap)
+		{
+			valid &= model.mapI2SBatchDeriv(x1, y1, num, X1, Y1, Z1, M1, J1);
+			valid &= model.mapI2SBatchDeriv(x2, y2, num, X2, Y2, Z2, M2, J2);
 			if (!valid)return false;
+		}
+
+		int paramNum = int(mvpParameter.size());
+		for (int i = 0; i < num; i++)
+		{
+			double *e = pErr + rows * i;
+			double q[3] = { pR[0] * X1[i] + pR[1] * Y1[i] + pR[2] * Z1[i],
+							pR[3] * X1[i] + pR[4] * Y1[i] + pR[5] * Z1[i],
+							pR[6] * X1[i] + pR[7] * Y1[i] + pR[8] * Z1[i] };
 
-			cv::Point3d spherePt1ByRot = RotatePoint(spherePt1, *(mpRot));
-			err.at<double>(idx, 0) = spherePt1ByRot.x - spherePt2.x;
-			err.at<double>(idx + 1, 0) = spherePt1ByRot.y - spherePt2.y;
-			err.at<double>(idx + 2, 0) = spherePt1ByRot.z - spherePt2.z;
+			double *jRow0 = pJac + rows * i * paramNum;
+			double *jRow1 = jRow0 + paramNum, *jRow2 = jRow1 + paramNum;
+			if (tangent)
+			{
+				//e_k = b_k(s2) . q, de_k = b_k . dq + g_k . ds2 with g_k = (db_k/ds2)^T * q
+				double s2[3] = { X2[i], Y2[i], Z2[i] }, b1[3], b2[3], g1[3], g2[3];
+				_tangentBasis(s2, b1, b2, q, g1, g2);
+				e[0] = b1[0] * q[0] + b1[1] * q[1] + b1[2] * q[2];
+				e[1] = b2[0] * q[0] + b2[1] * q[1] + b2[2] * q[2];
+
+				for (int k = 0; k < paramNum; k++)
+				{
+					int idx = mvParamIndex[k];
+					double dq[3];
+					if (mvRotMask[k])
+					{
+						const double *pdRk = pdR + idx * 9;
+						dq[0] = pdRk[0] * X1[i] + pdRk[1] * Y1[i] + pdRk[2] * Z1[i];
+						dq[1] = pdRk[3] * X1[i] + pdRk[4] * Y1[i] + pdRk[5] * Z1[i];
+						dq[2] = pdRk[6] * X1[i] + pdRk[7] * Y1[i] + pdRk[8] * Z1[i];
+						jRow0[k] = b1[0] * dq[0] + b1[1] * dq[1] + b1[2] * dq[2];
+						jRow1[k] = b2[0] * dq[0] + b2[1] * dq[1] + b2[2] * dq[2];
+					}
+					else
+					{
+						const double *dS1 = J1 + idx * 3 * num + i;
+						const double *dS2 = J2 + idx * 3 * num + i;
+						double dX1 = dS1[0], dY1 = dS1[num], dZ1 = dS1[2 * num];
+						double dX2 = dS2[0], dY2 = dS2[num], dZ2 = dS2[2 * num];
+						dq[0] = pR[0] * dX1 + pR[1] * dY1 + pR[2] * dZ1;
+						dq[1] = pR[3] * dX1 + pR[4] * dY1 + pR[5] * dZ1;
+						dq[2] = pR[6] * dX1 + pR[7] * dY1 + pR[8] * dZ1;
+						jRow0[k] = b1[0] * dq[0] + b1[1] * dq[1] + b1[2] * dq[2] + g1[0] * dX2 + g1[1] * dY2 + g1[2] * dZ2;
+						jRow1[k] = b2[0] * dq[0] + b2[1] * dq[1] + b2[2] * dq[2] + g2[0] * dX2 + g2[1] * dY2 + g2[2] * dZ2;
+					}
+				}
+				continue;
+			}
+
+			e[0] = q[0] - X2[i];
+			e[1] = q[1] - Y2[i];
+			e[2] = q[2] - Z2[i];
+			for (int k = 0; k < paramNum; k++)
+			{
+				int idx = mvParamIndex[k];
+				if (mvRotMask[k])
+				{
+					const double *pdRk = pdR + idx * 9;
+					jRow0[k] = pdRk[0] * X1[i] + pdRk[1] * Y1[i] + pdRk[2] * Z1[i];
+					jRow1[k] = pdRk[3] * X1[i] + pdRk[4] * Y1[i] + pdRk[5] * Z1[i];
+					jRow2[k] = pdRk[6] * X1[i] + pdRk[7] * Y1[i] + pdRk[8] * Z1[i];
+				}
+				else
+				{
+					const double *dS1 = J1 + idx * 3 * num + i;
+					const double *dS2 = J2 + idx * 3 * num + i;
+					double dX1 = dS1[0], dY1 = dS1[num], dZ1 = dS1[2 * num];
+					jRow0[k] = pR[0] * dX1 + pR[1] * dY1 + pR[2] * dZ1 - dS2[0];
+					jRow1[k] = pR[3] * dX1 + pR[4] * dY1 + pR[5] * dZ1 - dS2[num];
+					jRow2[k] = pR[6] * dX1 + pR[7] * dY1 + pR[8] * dZ1 - dS2[2 * num];
+				}
+			}
 		}
 
+		if (mLossType != LOSS_SQUARED) _weightRows(num, pErr, pJac, pCost);
 		return true;
 	}
 
+	//The orthonormal tangent basis b1, b2 of the unit vector n without branches except the
+	//sign of n.z (Duff et al., Building an Orthonormal Basis, Revisited, JCGT 2017).
+	//g_k = (db_k/dn)^T * q is also computed if q is not NULL
+	static void _tangentBasis(const double *n, double *b1, double *b2,
+							  const double *q = NULL, double *g1 = NULL, double *g2 = NULL)
+	{
+		double x = n[0], y = n[1], z = n[2];
+		double sign = z >= 0 ? 1.0 : -1.0;
+		double a = -1.0 / (sign + z), b = x * y * a;
+		b1[0] = 1 + sign * x * x * a;
+		b1[1] = sign * b;
+		b1[2] = -sign * x;
+		b2[0] = b;
+		b2[1] = sign + y * y * a;
+		b2[2] = -y;
+		if (q == NULL) return;
+
+		//da/dz = a^2
+		double t = a * a * (x * q[0] + y * q[1]);
+		g1[0] = sign * (2 * x * a * q[0] + y * a * q[1] - q[2]);
+		g1[1] = sign * x * a * q[1];
+		g1[2] = sign * x * t;
+		g2[0] = y * a * q[0];
+		g2[1] = x * a * q[0] + 2 * y * a * q[1] - q[2];
+		g2[2] = y * t;
+	}
+
+	//the loss rho(s) of the squared residual norm s and the IRLS weight w = rho'(s),
+	//rho(s) is about s for the small residuals
+	void _robustLoss(double s, double &rho, double &w) const
+	{
+		double c2 = mLossScale * mLossScale;
+		switch (mLossType)
+		{
+		case LOSS_HUBER:
+			if (s <= c2)
+			{
+				rho = s;
+				w = 1;
+			}
+			else
+			{
+				double r = sqrt(s);
+				rho = 2 * mLossScale * r - c2;
+				w = mLossScale / r;
+			}
+			break;
+		case LOSS_CAUCHY:
+			rho = c2 * log1p(s / c2);
+			w = 1 / (1 + s / c2);
+			break;
+		case LOSS_TUKEY:
+			if (s < c2)
+			{
+				double t = 1 - s / c2;
+				rho = c2 / 3 * (1 - t * t * t);
+				w = t * t;
+			}
+			else
+			{
+				rho = c2 / 3;
+				w = 0;
+			}
+			break;
+		default:
+			rho = s;
+			w = 1;
+			break;
+		}
+	}
+
+	//scale the rows of every pair by sqrt(w), then J^T * J and J^T * r are the IRLS
+	//ones and J^T * r is exactly the half gradient of sum(rho), pCost adds sum(rho)
+	void _weightRows(int num, double *pErr, double *pJac, double *pCost) const
+	{
+		int paramNum = int(mvpParameter.size());
+		int rows = getRowsPerPair();
+		double cost = 0;
+		for (int i = 0; i < num; i++)
+		{
+			double *e = pErr + rows * i;
+			double s = 0;
+			for (int c = 0; c < rows; c++) s += e[c] * e[c];
+			double rho, w;
+			_robustLoss(s, rho, w);
+			cost += rho;
+
+			double sw = sqrt(w);
+			for (int c = 0; c < rows; c++) e[c] *= sw;
+			if (pJac != NULL)
+			{
+				double *jRow = pJac + rows * i * paramNum;
+				for (int k = 0; k < rows * paramNum; k++) jRow[k] *= sw;
+			}
+		}
+		if (pCost != NULL) *pCost += cost;
+	}
+
 	bool _calcJacobian(cv::Mat &jac) const
 	{
 		int pairNum = mpModelData->mcount;
@@ -148,9 +945,10 @@ private:
 		jac.setTo(0);
 
 		const double step = 1e-6;
-		cv::Mat err1, err2;
-		err1.create(pairNum * 3, 1, CV_64F);
-		err2.create(pairNum * 3, 1, CV_64F);
+		//the buffers are kept between the calls
+		cv::Mat &err1 = mNumericErr1, &err2 = mNumericErr2;
+		err1.create(pairNum * getRowsPerPair(), 1, CV_64F);
+		err2.create(pairNum * getRowsPerPair(), 1, CV_64F);
 		bool valid = true;
 
 		for (size_t i = 0; i < mvpParameter.size(); i++)
@@ -187,6 +985,7 @@ private:
 		else
 		{
 			mpModel->updateFov();
+			mpModel->updateCache();
 		}
 	}
 
@@ -196,8 +995,399 @@ private:
 	std::vector<double *> mvpParameter;
 	std::vector<bool> mvRotMask;
 
+	//the index in CameraModel::vpParameter or in the axisAngle of each active parameter
+	std::vector<int> mvParamIndex;
+	JacobianMode mJacobianMode;
+
+	std::shared_ptr<const PairImagePoints> mpImgPts;
+	mutable SpherePointArray mSpherePts1, mSpherePts2;
+
+	bool mbParallel;
+	int mBlockSize;
+	mutable std::vector<uchar> mvBlockValid;
+	mutable cv::Mat mNumericErr1, mNumericErr2;
+
+	//the scratch and the partial sums of one stripe of computeNormal
+	enum { NORMAL_STRIPE_NUM = 16 };
+	struct NormalStripe
+	{
+		SpherePointArray spherePts1, spherePts2;
+		std::vector<double> err, jac;
+		cv::NormalEquation normal;
+		uchar valid;
+	};
+
+	bool mbMatrixFree;
+	mutable std::vector<NormalStripe> mvStripe;
+
+	//the intrinsic parameters of the mapping held by mSpherePts1/2, empty if it is not valid
+	bool mbMappingCache;
+	mutable std::vector<double> mvMappedIntrinsic;
+	mutable bool mbMappedDeriv;
+	//the intrinsic parameters of the last updateFov and updateCache
+	mutable std::vector<double> mvUpdatedIntrinsic;
+
+	LossType mLossType;
+	double mLossScale;
+	ResidualType mResidualType;
+
+};
+
+
+//The outlier handling of RefineGeneralModel, the default is the plain least squares.
+//ransacThreshold > 0 replaces the initial rotation by CalculateRotationRansac,
+//the thresholds and the loss scale are sphere residuals (about radian)
+struct RobustRefineConfig
+{
+	RobustRefineConfig() :
+		loss(FishModelRefineCallback::LOSS_SQUARED), lossScale(0.01),
+		ransacThreshold(0), ransacIterations(1000), seed(0) {}
+
+	FishModelRefineCallback::LossType loss;
+	double lossScale;
+	double ransacThreshold;
+	int ransacIterations;
+	uint64_t seed;
+};
+
+//The solve path and the stop rules of RefineGeneralModel, the defaults are the ones of the
+//original drivers, ANALYTIC_JACOBIAN with matrixFree accumulates J^T * J by the blocks of pairs.
+//The tolerances go to LMSolverImpl::setTermination/setStallDetection, 0 disables them
+struct RefineOptions
+{
+	RefineOptions() : jacobianMode(FishModelRefineCallback::NUMERIC_JACOBIAN), matrixFree(false),
+		epsDecrease(0), epsGradient(0), stallIters(0), stallTolerance(0) {}
+
+	FishModelRefineCallback::JacobianMode jacobianMode;
+	bool matrixFree;
+	double epsDecrease, epsGradient;
+	int stallIters;
+	double stallTolerance;
+};
+
+//Refine only the rotation with the camera model fixed, the sphere points are mapped once
+//and reused by all the evaluations. Return the LM iterations
+inline int RefineRotation(const std::shared_ptr<ModelDataProducer> &pModelData,
+						  const std::shared_ptr<CameraModel> &pModel,
+						  const std::shared_ptr<Rotation> &pRot, bool parallel = true)
+{
+	std::vector<uchar> vMask(pModel->vpParameter.size(), 0);
+	cv::Ptr<FishModelRefineCallback> cb = cv::makePtr<FishModelRefineCallback>(pModelData, pModel, pRot, vMask);
+	cb->setParallel(parallel);
+	cv::Ptr<cv::LMSolverImpl> levmarpPtr = cv::makePtr<cv::LMSolverImpl>(cb, 100, FLT_EPSILON, FLT_EPSILON, "");
+
+	cv::Mat param(3, 1, CV_64FC1);
+	for (int i = 0; i < 3; i++)
+	{
+		param.at<double>(i, 0) = pRot->axisAngle[i];
+	}
+	int iterations = levmarpPtr->run(param);
+
+	pRot->updataRotation(cv::Vec3d(param.at<double>(0, 0), param.at<double>(1, 0), param.at<double>(2, 0)));
+	return iterations;
+}
+
+//one initial guess of RefineGeneralModels
+struct RefineStart
+{
+	RefineStart(const std::string &_typeName = "", const cv::Vec2d &_args = cv::Vec2d(0, 0), double _f = 1) :
+		typeName(_typeName), args(_args), f(_f) {}
+
+	std::string typeName;
+	cv::Vec2d args;
+	double f;
+};
+
+//the refined model and the statistics of one refinement
+struct RefineResult
+{
+	RefineResult() : error(DBL_MAX), rotError(DBL_MAX), iterations(0), termination(cv::LM_TERM_NONE), seconds(0) {}
+
+	RefineStart start;
+	std::shared_ptr<CameraModel> pModel;
+	std::shared_ptr<Rotation> pRot;
+	//error is -1 if the final parameters can not be evaluated (some pairs map out of the model)
+	double error, rotError;
+	//the LM iterations, negative if the iteration limit is reached
+	int iterations;
+	cv::LMTerminationReason termination;
+	double seconds;
+};
+
+//Refine a general camera model with the synthetic data of one trial, the model is
+//initialized with the focal length start.f and the coefficients start.args, u0 and v0
+//are fixed. error is the norm of the final residual (sqrt(sum(rho)) with a robust loss),
+//rotError is the distance between the refined and the true axis-angle. The evaluation of
+//the callback is serial if parallel is false, which is the choice when the trials
+//themselves run in parallel. pImgPts are the shared image points of pModelData
+inline void RefineGeneralModel(const std::shared_ptr<ModelDataProducer> &pModelData,
+							   const std::shared_ptr<const PairImagePoints> &pImgPts,
+							   const RefineStart &start, RefineResult &result, bool parallel = true,
+							   const RobustRefineConfig &robust = RobustRefineConfig(),
+							   const RefineOptions &options = RefineOptions())
+{
+	int64 startTick = cv::getTickCount();
+	double maxRadius = pModelData->mpCam->maxRadius;
+	std::shared_ptr<CameraModel> pModel = createCameraModel(start.typeName, 0, 0, start.f, 0, maxRadius,
+															start.args[0], start.args[1]);
+
+	//the initial rotation is replaced by the least squares one, it is given explicitly
+	//so that the job does not touch the global random state
+	std::shared_ptr<Rotation> pRot = std::make_shared<Rotation>(cv::Vec3d(0, 0, 1), CV_PI*0.5);
+	if (robust.ransacThreshold > 0)
+	{
+		RandomStream rng(robust.seed);
+		CalculateRotationRansac(*pImgPts, pModel, pRot, robust.ransacThreshold, robust.ransacIterations, rng);
+	}
+	else
+	{
+		CalculateRotation(*pImgPts, pModel, pRot);
+	}
+	std::vector<uchar> vMask(pModel->vpParameter.size(), 1);
+	vMask[0] = vMask[1] = 0;
+
+	cv::Ptr<FishModelRefineCallback> cb = cv::makePtr<FishModelRefineCallback>(pModelData, pModel, pRot, vMask, pImgPts);
+	cb->setParallel(parallel);
+	cb->setJacobianMode(options.jacobianMode);
+	cb->setMatrixFree(options.matrixFree);
+	if (robust.loss != FishModelRefineCallback::LOSS_SQUARED)
+		cb->setLoss(robust.loss, robust.lossScale);
+	cv::Ptr<cv::LMSolverImpl> levmarpPtr = cv::makePtr<cv::LMSolverImpl>(cb, 200, FLT_EPSILON, FLT_EPSILON, "");
+	levmarpPtr->setTermination(options.epsDecrease, options.epsGradient);
+	levmarpPtr->setStallDetection(options.stallIters, options.stallTolerance);
+
+	//param = {f, model coefficients, axisAngle}
+	int intrinsicNum = int(pModel->vpParameter.size()) - 2;
+	cv::Mat param(intrinsicNum + 3, 1, CV_64FC1);
+	for (int i = 0; i < intrinsicNum; i++)
+	{
+		param.at<double>(i, 0) = *(pModel->vpParameter[i + 2]);
+	}
+	for (int i = 0; i < 3; i++)
+	{
+		param.at<double>(intrinsicNum + i, 0) = pRot->axisAngle[i];
+	}
+
+	cv::LMSummary summary;
+	result.iterations = levmarpPtr->run(param, summary);
+	result.termination = summary.reason;
+
+	//this also leaves the final parameters in pModel and pRot
+	cv::NormalEquation normal;
+	bool valid = cb->computeNormal(param, normal, false);
+
+	result.start = start;
+	result.pModel = pModel;
+	result.pRot = pRot;
+	//S only covers a part of the pairs if the evaluation fails
+	result.error = valid ? std::sqrt(normal.S) : -1;
+	if (!valid) result.termination = cv::LM_TERM_FAILED;
+	result.rotError = cv::norm(pRot->axisAngle - pModelData->mpRot->axisAngle);
+	result.seconds = (cv::getTickCount() - startTick) / cv::getTickFrequency();
+}
+
+inline void RefineGeneralModel(const std::shared_ptr<ModelDataProducer> &pModelData,
+							   const std::string &typeName, const cv::Vec2d &args, double f,
+							   double &error, double &rotError, bool parallel = true,
+							   const RobustRefineConfig &robust = RobustRefineConfig())
+{
+	RefineResult result;
+	RefineGeneralModel(pModelData, std::make_shared<const PairImagePoints>(*pModelData),
+					   RefineStart(typeName, args, f), result, parallel, robust);
+	error = result.error;
+	rotError = result.rotError;
+}
+
+//the statistics of all the starts of one model type in RefineGeneralModels
+struct RefineModelStats
+{
+	RefineModelStats() : startNum(0), failedNum(0), bestStart(-1), bestError(DBL_MAX), meanError(0), meanIterations(0), seconds(0) {}
+
+	//meanError is over the startNum - failedNum starts that did not fail
+	int startNum, failedNum;
+	//the index of the best start in vStart
+	int bestStart;
+	double bestError, meanError, meanIterations;
+	double seconds;
 };
 
+//Fit several models and initial guesses to one dataset. The image points are converted
+//once and shared by all the refinements, and the starts are scheduled as the jobs of a
+//TrialRunner (each refinement is then serial), so a slow model does not hold the others.
+//vResult[i] is the result of vStart[i], pModelStats gets the statistics of every model
+//type if it is not NULL. Return the index of the start with the smallest error, -1 if all of them failed
+inline int RefineGeneralModels(const std::shared_ptr<ModelDataProducer> &pModelData,
+							   const std::vector<RefineStart> &vStart, std::vector<RefineResult> &vResult,
+							   std::map<std::string, RefineModelStats> *pModelStats = NULL, bool parallel = true,
+							   const RobustRefineConfig &robust = RobustRefineConfig(),
+							   const RefineOptions &options = RefineOptions())
+{
+	int startNum = int(vStart.size());
+	vResult.assign(startNum, RefineResult());
+	if (startNum == 0) return -1;
+
+	std::shared_ptr<const PairImagePoints> pImgPts = std::make_shared<const PairImagePoints>(*pModelData);
+	TrialRunner runner(parallel ? 0 : 1);
+	runner.run(1, 1, startNum, [&](int level, int trial, int s)
+	{
+		RefineGeneralModel(pModelData, pImgPts, vStart[s], vResult[s], false, robust, options);
+	});
+
+	int best = -1;
+	for (int s = 0; s < startNum; s++)
+	{
+		if (vResult[s].error >= 0 && (best < 0 || vResult[s].error < vResult[best].error)) best = s;
+	}
+
+	if (pModelStats != NULL)
+	{
+		pModelStats->clear();
+		for (int s = 0; s < startNum; s++)
+		{
+			RefineModelStats &stats = (*pModelStats)[vStart[s].typeName];
+			const RefineResult &result = vResult[s];
+			stats.startNum++;
+			stats.meanIterations += std::abs(result.iterations);
+			stats.seconds += result.seconds;
+			if (result.error < 0)
+			{
+				stats.failedNum++;
+				continue;
+			}
+			stats.meanError += result.error;
+			if (result.error < stats.bestError)
+			{
+				stats.bestError = result.error;
+				stats.bestStart = s;
+			}
+		}
+		for (auto iter = pModelStats->begin(); iter != pModelStats->end(); iter++)
+		{
+			int validNum = iter->second.startNum - iter->second.failedNum;
+			iter->second.meanError = validNum > 0 ? iter->second.meanError / validNum : -1;
+			iter->second.meanIterations /= iter->second.startNum;
+		}
+	}
+
+	return best;
+}
+
+//The Monte-Carlo sweep of the optimize drivers. The level has levelConfig(level).trialNum
+//synthetic trials, each of them refined from every start of generalModelInfo, and all the
+//(level, trial, model) jobs are scheduled at once by TrialRunner. A trial is produced by
+//the first of its jobs and released by the last one, the jobs of a trial are neighbours
+//in the queues so only the trials in flight are kept in memory.
+//vErrors[model][level] are the errors divided by the pair number of the trial and
+//vRotErrors[model][level] the rotation errors, of the trials whose refinement did not fail
+//(RefineResult::error < 0, or no pair was produced),
+//the indices of the failed trials are in (*pFailedTrials)[model][level]
+inline void RunRefineSweep(int levelNum, const std::function<SyntheticDataConfig(int level)> &levelConfig,
+						   const std::map<std::string, cv::Vec2d> &generalModelInfo,
+						   std::map<std::string, std::vector<std::vector<double>>> &vErrors,
+						   std::map<std::string, std::vector<std::vector<double>>> &vRotErrors,
+						   std::map<std::string, std::vector<std::vector<int>>> *pFailedTrials = NULL,
+						   const RefineOptions &options = RefineOptions())
+{
+	std::vector<std::string> vModelName;
+	std::vector<cv::Vec2d> vModelArgs;
+	for (auto iter = generalModelInfo.begin(); iter != generalModelInfo.end(); iter++)
+	{
+		vModelName.push_back(iter->first);
+		vModelArgs.push_back(iter->second);
+	}
+	int modelNum = int(vModelName.size());
+
+	std::vector<SyntheticDataFactory> vFactory;
+	int trialNum = 0;
+	for (int level = 0; level < levelNum; level++)
+	{
+		vFactory.push_back(SyntheticDataFactory(levelConfig(level)));
+		trialNum = std::max(trialNum, vFactory.back().getConfig().trialNum);
+	}
+
+	//the data of one trial, shared by the jobs of its models
+	struct TrialSlot
+	{
+		TrialSlot() : remaining(0) {}
+		std::mutex mutex;
+		std::shared_ptr<ModelDataProducer> pModelData;
+		std::shared_ptr<const PairImagePoints> pImgPts;
+		int remaining;
+	};
+	std::vector<TrialSlot> vSlot(size_t(levelNum) * trialNum);
+
+	FishEye::Equidistant baseModel(0, 0, 1, CV_PI);
+	TrialResultTable errorTable(levelNum, trialNum, modelNum), rotErrorTable(levelNum, trialNum, modelNum);
+	TrialResultTable failTable(levelNum, trialNum, modelNum);
+	TrialRunner runner;
+	runner.run(levelNum, trialNum, modelNum, [&](int level, int i, int m)
+	{
+		if (i >= vFactory[level].getConfig().trialNum) return;
+
+		TrialSlot &slot = vSlot[size_t(level) * trialNum + i];
+		std::shared_ptr<ModelDataProducer> pModelData;
+		std::shared_ptr<const PairImagePoints> pImgPts;
+		{
+			std::lock_guard<std::mutex> lock(slot.mutex);
+			if (slot.remaining == 0)
+			{
+				slot.pModelData = vFactory[level].produce(i);
+				slot.pImgPts = std::make_shared<const PairImagePoints>(*slot.pModelData);
+				slot.remaining = modelNum;
+			}
+			pModelData = slot.pModelData;
+			pImgPts = slot.pImgPts;
+		}
+
+		//a trial may have less pairs than asked (see ModelDataProducer::produce), the error
+		//is divided by the pairs it really has, a trial without any counts as failed
+		int pairNum = pModelData->mcount;
+		double f = pModelData->mpCam->maxRadius / baseModel.maxRadius;
+		RefineResult result;
+		if (pairNum > 0)
+		{
+			RefineGeneralModel(pModelData, pImgPts, RefineStart(vModelName[m], vModelArgs[m], f), result, false,
+							   RobustRefineConfig(), options);
+		}
+		else result.error = -1;
+		errorTable.at(level, i, m) = result.error >= 0 ? result.error / pairNum : -1;
+		rotErrorTable.at(level, i, m) = result.rotError;
+		failTable.at(level, i, m) = result.error < 0;
+
+		std::lock_guard<std::mutex> lock(slot.mutex);
+		if (--slot.remaining == 0)
+		{
+			slot.pModelData.reset();
+			slot.pImgPts.reset();
+		}
+	});
+
+	if (pFailedTrials != NULL) pFailedTrials->clear();
+	for (int m = 0; m < modelNum; m++)
+	{
+		const std::string &name = vModelName[m];
+		vErrors[name].assign(levelNum, std::vector<double>());
+		vRotErrors[name].assign(levelNum, std::vector<double>());
+		std::vector<std::vector<int>> vFailed(levelNum);
+		for (int level = 0; level < levelNum; level++)
+		{
+			int levelTrialNum = vFactory[level].getConfig().trialNum;
+			for (int i = 0; i < levelTrialNum; i++)
+			{
+				if (failTable.at(level, i, m) != 0)
+				{
+					vFailed[level].push_back(i);
+					continue;
+				}
+				vErrors[name][level].push_back(errorTable.at(level, i, m));
+				vRotErrors[name][level].push_back(rotErrorTable.at(level, i, m));
+			}
+			std::cout << name << " level " << level << " finished " << levelTrialNum << " trials, "
+				<< vFailed[level].size() << " failed" << std::endl;
+		}
+		if (pFailedTrials != NULL) (*pFailedTrials)[name] = vFailed;
+	}
+}
 
 inline void SaveErrorsToFileOld(std::map<std::string, std::vector<std::vector<double>>> &vErrors,
 							double ratio, double base, const std::string &dir, const std::string &subName)
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <OpencvCommon.h>
+#include <cstdint>
+#include <cstring>
+
+//The counter-based random generator (Philox4x32-10), the i-th output of a stream
+//is a pure function of (seed, stream, i), so every trial can own an independent
+//substream and the results do not depend on the thread that produces the trial.
+//Random123: Salmon et al., Parallel Random Numbers: As Easy as 1, 2, 3, SC 2011
+class RandomStream
+{
+public:
+	RandomStream(uint64_t seed = 0, uint64_t stream = 0) :
+		mSeed(seed), mStream(stream), mBlock(0), mUsed(4), mbHasNormal(false), mNormal(0) {}
+	~RandomStream() {}
+
+	//the independent stream idx of the same seed
+	RandomStream substream(uint64_t idx) const
+	{
+		return RandomStream(mSeed, idx);
+	}
+
+	uint32_t nextUInt()
+	{
+		if (mUsed == 4)
+		{
+			_generateBlock();
+			mUsed = 0;
+		}
+		return mOutput[mUsed++];
+	}
+
+	//uniform in [0, 1) with 53 random bits
+	double uniform()
+	{
+		uint64_t a = nextUInt() >> 5, b = nextUInt() >> 6;
+		return (a * 67108864.0 + b) * (1.0 / 9007199254740992.0);
+	}
+
+	//uniform in [minValue, maxValue)
+	double uniform(double minValue, double maxValue)
+	{
+		return minValue + uniform() * (maxValue - minValue);
+	}
+
+	//uniform integer in [minValue, maxValue)
+	int uniformInt(int minValue, int maxValue)
+	{
+		assert(maxValue > minValue);
+		int value = minValue + int(uniform() * (maxValue - minValue));
+		return std::min(value, maxValue - 1);
+	}
+
+	//Marsaglia polar method, the second value of the pair is kept for the next call
+	double normal(double mean = 0.0, double sigma = 1.0)
+	{
+		if (mbHasNormal)
+		{
+			mbHasNormal = false;
+			return mean + sigma * mNormal;
+		}
+
+		double u, v, s;
+		do
+		{
+			u = uniform() * 2.0 - 1.0;
+			v = uniform() * 2.0 - 1.0;
+			s = u * u + v * v;
+		} while (s >= 1.0 || s == 0.0);
+
+		double scale = sqrt(-2.0 * log(s) / s);
+		mNormal = v * scale;
+		mbHasNormal = true;
+		return mean + sigma * u * scale;
+	}
+
+	//uniform direction on the unit sphere
+	cv::Vec3d axis()
+	{
+		double z = uniform() * 2.0 - 1.0;
+		double theta = CV_2PI * uniform();
+		double r = sqrt(std::max(1.0 - z * z, 0.0));
+		return cv::Vec3d(r * cos(theta), r * sin(theta), z);
+	}
+
+private:
+	static uint32_t _mulhilo(uint32_t a, uint32_t b, uint32_t &hi)
+	{
+		uint64_t product = uint64_t(a) * b;
+		hi = uint32_t(product >> 32);
+		return uint32_t(product);
+	}
+
+	void _generateBlock()
+	{
+		uint32_t ctr[4] = { uint32_t(mBlock), uint32_t(mBlock >> 32),
+							uint32_t(mStream), uint32_t(mStream >> 32) };
+		uint32_t key[2] = { uint32_t(mSeed), uint32_t(mSeed >> 32) };
+
+		for (int round = 0; round < 10; round++)
+		{
+			uint32_t hi0, hi1;
+			uint32_t lo0 = _mulhilo(0xD2511F53u, ctr[0], hi0);
+			uint32_t lo1 = _mulhilo(0xCD9E8D57u, ctr[2], hi1);
+			uint32_t next[4] = { hi1 ^ ctr[1] ^ key[0], lo1, hi0 ^ ctr[3] ^ key[1], lo0 };
+			memcpy(ctr, next, sizeof(ctr));
+			key[0] += 0x9E3779B9u;
+			key[1] += 0xBB67AE85u;
+		}
+
+		memcpy(mOutput, ctr, sizeof(ctr));
+		mBlock++;
+	}
+
+	uint64_t mSeed, mStream, mBlock;
+	uint32_t mOutput[4];
+	int mUsed;
+	bool mbHasNormal;
+	double mNormal;
+};
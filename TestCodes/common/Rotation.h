@@ -1,11 +1,112 @@
 #pragma once
 #include <OpencvCommon.h>
 #include <opencv2/calib3d/calib3d.hpp>
+#include "RandomStream.h"
+
+//the skew-symmetric matrix [w]x, [w]x * p = w.cross(p)
+inline cv::Matx33d SkewMatrix(const cv::Vec3d &w)
+{
+	return cv::Matx33d(0, -w[2], w[1],
+					   w[2], 0, -w[0],
+					   -w[1], w[0], 0);
+}
+
+//the closed-form exponential map of the axis-angle (Rodrigues formula)
+//R = I + a * [w]x + b * [w]x^2, a = sin(theta) / theta, b = (1 - cos(theta)) / theta^2
+inline cv::Matx33d ExpMap(const cv::Vec3d &w)
+{
+	double theta2 = w[0] * w[0] + w[1] * w[1] + w[2] * w[2];
+	double a, b;
+	if (theta2 < 1e-8)
+	{
+		//the Taylor expansion avoids 0 / 0 near the identity
+		a = 1 - theta2 / 6.0;
+		b = 0.5 - theta2 / 24.0;
+	}
+	else
+	{
+		double theta = sqrt(theta2);
+		a = sin(theta) / theta;
+		b = (1 - cos(theta)) / theta2;
+	}
+
+	double xx = w[0] * w[0], yy = w[1] * w[1], zz = w[2] * w[2];
+	double xy = w[0] * w[1], xz = w[0] * w[2], yz = w[1] * w[2];
+	return cv::Matx33d(1 - b * (yy + zz), -a * w[2] + b * xy, a * w[1] + b * xz,
+					   a * w[2] + b * xy, 1 - b * (xx + zz), -a * w[0] + b * yz,
+					   -a * w[1] + b * xz, a * w[0] + b * yz, 1 - b * (xx + yy));
+}
+
+//the closed-form logarithm map of the rotation matrix, the angle is in [0, pi]
+inline cv::Vec3d LogMap(const cv::Matx33d &R)
+{
+	const double *r = R.val;
+	//|v| = 2 * sin(theta), atan2 keeps the angle accurate near 0 and pi where acos does not
+	cv::Vec3d v(r[7] - r[5], r[2] - r[6], r[3] - r[1]);
+	double cosTheta = std::max(-1.0, std::min(1.0, (r[0] + r[4] + r[8] - 1) * 0.5));
+	double sinTheta = 0.5 * sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+	double theta = atan2(sinTheta, cosTheta);
+
+	if (theta < 1e-4)
+	{
+		//sin(theta) / theta is about 1 - theta^2 / 6
+		double scale = 0.5 * (1 + theta * theta / 6.0);
+		return cv::Vec3d(v[0] * scale, v[1] * scale, v[2] * scale);
+	}
+
+	if (CV_PI - theta > 1e-4)
+	{
+		double scale = theta / (2 * sinTheta);
+		return cv::Vec3d(v[0] * scale, v[1] * scale, v[2] * scale);
+	}
+
+	//near pi the antisymmetric part vanishes, the axis is taken from the symmetric part
+	//(R + R^T) / 2 - cos(theta) * I = (1 - cos(theta)) * n * n^T, using its largest diagonal entry
+	int k = 0;
+	if (r[4] > r[k * 4]) k = 1;
+	if (r[8] > r[k * 4]) k = 2;
+	cv::Vec3d n;
+	for (int i = 0; i < 3; i++)
+	{
+		n[i] = (r[i * 3 + k] + r[k * 3 + i]) * 0.5 - (i == k ? cosTheta : 0);
+	}
+	double norm = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+	//the sign follows the antisymmetric part, if it is not too small
+	double sign = (n[0] * v[0] + n[1] * v[1] + n[2] * v[2]) < 0 ? -1 : 1;
+	double scale = sign * theta / norm;
+	return cv::Vec3d(n[0] * scale, n[1] * scale, n[2] * scale);
+}
+
+//the left Jacobian of SO(3), d(ExpMap(w) * p)/dw = -[ExpMap(w) * p]x * J_l
+//J_l = I + b * [w]x + c * [w]x^2, b = (1 - cos(theta)) / theta^2, c = (theta - sin(theta)) / theta^3
+inline cv::Matx33d LeftJacobian(const cv::Vec3d &w)
+{
+	double theta2 = w[0] * w[0] + w[1] * w[1] + w[2] * w[2];
+	double b, c;
+	if (theta2 < 1e-8)
+	{
+		b = 0.5 - theta2 / 24.0;
+		c = 1 / 6.0 - theta2 / 120.0;
+	}
+	else
+	{
+		double theta = sqrt(theta2);
+		b = (1 - cos(theta)) / theta2;
+		c = (theta - sin(theta)) / (theta2 * theta);
+	}
+
+	double xx = w[0] * w[0], yy = w[1] * w[1], zz = w[2] * w[2];
+	double xy = w[0] * w[1], xz = w[0] * w[2], yz = w[1] * w[2];
+	return cv::Matx33d(1 - c * (yy + zz), -b * w[2] + c * xy, b * w[1] + c * xz,
+					   b * w[2] + c * xy, 1 - c * (xx + zz), -b * w[0] + c * yz,
+					   -b * w[1] + c * xz, b * w[0] + c * yz, 1 - c * (xx + yy));
+}
 
 class Rotation
 {
 public:
-	//minAngle and maxAngle is radian
+	//minAngle and maxAngle is radian, this one draws from the global rand(),
+	//use the RandomStream version for the reproducible data
 	Rotation(double minAngle = 0.0, double maxAngle = CV_2PI)
 	{
 		assert(maxAngle >= minAngle);
@@ -13,16 +114,22 @@ public:
 		double ratio = rand() / double(RAND_MAX);
 		double angle = minAngle + ratio * (maxAngle - minAngle);
 
-		axisAngle = axis * angle;
-		cv::Rodrigues(axisAngle, R);
-		//R = _axisAngleToMatrix(axis, angle);
+		updataRotation(axis * angle);
+	}
+
+	//the random axis and angle are drawn from rng
+	Rotation(double minAngle, double maxAngle, RandomStream &rng)
+	{
+		assert(maxAngle >= minAngle);
+		cv::Vec3d axis = rng.axis();
+		double angle = rng.uniform(minAngle, maxAngle);
+
+		updataRotation(axis * angle);
 	}
 
 	Rotation(const cv::Vec3d &ax, double radian)
 	{
-		axisAngle = ax * radian;
-		cv::Rodrigues(axisAngle, R);
-		//R = _axisAngleToMatrix(axis, angle);
+		updataRotation(ax * radian);
 	}
 
 	Rotation(const cv::Vec3d &_axisAngle)
@@ -30,6 +137,11 @@ public:
 		updataRotation(_axisAngle);
 	}
 
+	Rotation(const cv::Matx33d &_R)
+	{
+		updataRotation(_R);
+	}
+
 	Rotation(const cv::Mat &_R)
 	{
 		updataRotation(_R);
@@ -38,54 +150,67 @@ public:
 	void updataRotation(const cv::Vec3d &_axisAngle)
 	{
 		axisAngle = _axisAngle;
-		
-		cv::Rodrigues(axisAngle, R);
-		/*double radian = cv::norm(_axisAngle);
-		cv::Vec3d ax = _axisAngle * (1.0 / radian);
-		R = _axisAngleToMatrix(ax, radian);*/
+		R = ExpMap(axisAngle);
+	}
+
+	void updataRotation(const cv::Matx33d &_R)
+	{
+		R = _R;
+		axisAngle = LogMap(R);
 	}
 
 	void updataRotation(const cv::Mat &_R)
 	{
-		_R.copyTo(R);
-		cv::Rodrigues(R, axisAngle);
+		assert(_R.rows == 3 && _R.cols == 3 && _R.type() == CV_64FC1);
+		updataRotation(cv::Matx33d(_R.ptr<double>(0)[0], _R.ptr<double>(0)[1], _R.ptr<double>(0)[2],
+								   _R.ptr<double>(1)[0], _R.ptr<double>(1)[1], _R.ptr<double>(1)[2],
+								   _R.ptr<double>(2)[0], _R.ptr<double>(2)[1], _R.ptr<double>(2)[2]));
 	}
 
-	cv::Vec3d axisAngle;
-	cv::Mat R;
-
-private:
-	
-
-	//this function is deprecated replaced by cv::Rodrigues
-	//axis-angle to rotation matrix formula follow
-	//http://www.euclideanspace.com/maths/geometry/rotations/conversions/angleToMatrix/
-	cv::Mat _axisAngleToMatrix(const cv::Vec3d &ax, double &radian)
-	{
-		double s = sin(radian);
-		double c_1 = cos(radian) - 1;
-
-		cv::Mat M = cv::Mat(3, 3, CV_64FC1);
-		double *pR = reinterpret_cast<double *>(M.data);
-		pR[0] = 1 - c_1 * (ax[0] * ax[0] - 1);
-		pR[1] = -ax[2] * s - c_1 * ax[0] * ax[1];
-		pR[2] = ax[1] * s - c_1 * ax[0] * ax[2];
-		pR[3] = ax[2] * s - c_1 * ax[0] * ax[1];
-		pR[4] = 1 - c_1 * (ax[1] * ax[1] - 1);
-		pR[5] = -ax[0] * s - c_1 * ax[1] * ax[2];
-		pR[6] = -ax[1] * s - c_1 * ax[0] * ax[2];
-		pR[7] = ax[0] * s - c_1 * ax[1] * ax[2];
-		pR[8] = 1 - c_1 * (ax[2] * ax[2] - 1);
-		return M;
+	//the derivatives of R with respect to the axis-angle,
+	//dR[k] = d(R)/d(axisAngle[k]) = [J_l * e_k]x * R
+	void computeDerivative(cv::Matx33d dR[3]) const
+	{
+		cv::Matx33d J = LeftJacobian(axisAngle);
+		for (int k = 0; k < 3; k++)
+		{
+			dR[k] = SkewMatrix(cv::Vec3d(J.val[k], J.val[3 + k], J.val[6 + k])) * R;
+		}
 	}
+
+	cv::Vec3d axisAngle;
+	cv::Matx33d R;
 };
 
 inline cv::Point3d RotatePoint(const cv::Point3d &srcPt, const Rotation &rot)
 {
-	double *pR = reinterpret_cast<double *>(rot.R.data);
+	const double *pR = rot.R.val;
 	return cv::Point3d(pR[0] * srcPt.x + pR[1] * srcPt.y + pR[2] * srcPt.z,
 					   pR[3] * srcPt.x + pR[4] * srcPt.y + pR[5] * srcPt.z,
 					   pR[6] * srcPt.x + pR[7] * srcPt.y + pR[8] * srcPt.z);
 }
 
+//rotate the structure-of-arrays points, the loop has no dependency between
+//the points so the compiler is free to vectorize it, dst can not alias src
+inline void RotatePoints(const Rotation &rot, const double *X, const double *Y, const double *Z, int num,
+						 double *dstX, double *dstY, double *dstZ)
+{
+	const double r0 = rot.R.val[0], r1 = rot.R.val[1], r2 = rot.R.val[2];
+	const double r3 = rot.R.val[3], r4 = rot.R.val[4], r5 = rot.R.val[5];
+	const double r6 = rot.R.val[6], r7 = rot.R.val[7], r8 = rot.R.val[8];
+	for (int i = 0; i < num; i++)
+	{
+		double x = X[i], y = Y[i], z = Z[i];
+		dstX[i] = r0 * x + r1 * y + r2 * z;
+		dstY[i] = r3 * x + r4 * y + r5 * z;
+		dstZ[i] = r6 * x + r7 * y + r8 * z;
+	}
+}
 
+//the derivative of R * p with respect to the axis-angle,
+//d(R * p)/d(axisAngle) = -[R * p]x * J_l, the kth column is J_l.col(k) x (R * p)
+inline cv::Matx33d RotatePointDeriv(const cv::Point3d &srcPt, const Rotation &rot)
+{
+	cv::Point3d q = RotatePoint(srcPt, rot);
+	return -1.0 * (SkewMatrix(cv::Vec3d(q.x, q.y, q.z)) * LeftJacobian(rot.axisAngle));
+}
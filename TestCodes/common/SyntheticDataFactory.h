@@ -0,0 +1,137 @@
+#pragma once
+
+#include "CameraModel.h"
+#include "Rotation.h"
+#include "ModelDataProducer.h"
+#include "RandomStream.h"
+#include <functional>
+
+//The settings of the synthetic data, the defaults are the ones of CameraDataFactory.exe
+struct SyntheticDataConfig
+{
+	SyntheticDataConfig() :
+		pairNum(300), trialNum(500), sigma(0.0), translateLen(0.0), seed(0), parallel(true),
+		minFocal(400), maxFocal(600),
+		minFov(CV_PI * (160 / 180.0)), maxFov(CV_PI * (200 / 180.0)),
+		minAngle(CV_PI * (70 / 180.0)), maxAngle(CV_PI * (110 / 180.0)) {}
+
+	int pairNum, trialNum;
+	double sigma, translateLen;
+	//the trial i always uses the substream i of seed
+	uint64_t seed;
+	bool parallel;
+	double minFocal, maxFocal;
+	double minFov, maxFov;
+	double minAngle, maxAngle;
+};
+
+//Produce the trials of the synthetic data in memory, every trial uses a random
+//classic fisheye model and a random rotation, and is handed to the consumer
+//directly, without the text file round-trip. The trials are drawn from their own
+//random substreams, so the data is the same with or without the parallel generation
+class SyntheticDataFactory
+{
+public:
+	typedef std::function<void(int trial, const std::shared_ptr<ModelDataProducer> &pModelData)> Consumer;
+
+	SyntheticDataFactory(const SyntheticDataConfig &config) : mConfig(config) {}
+	~SyntheticDataFactory() {}
+
+	//produce the trial of the index
+	std::shared_ptr<ModelDataProducer> produce(int trial) const
+	{
+		static const std::string classicModelName[3] = { "Equidistant", "Equisolid", "Stereographic" };
+
+		RandomStream rng(mConfig.seed, uint64_t(trial));
+		double fov = rng.uniform(mConfig.minFov, mConfig.maxFov);
+		double f = rng.uniform(mConfig.minFocal, mConfig.maxFocal);
+		int typeIdx = rng.uniformInt(0, 3);
+
+		std::shared_ptr<CameraModel> pModel = createCameraModel(classicModelName[typeIdx], 0, 0, f, fov, 0);
+		std::shared_ptr<Rotation> pRotation = std::make_shared<Rotation>(mConfig.minAngle, mConfig.maxAngle, rng);
+
+		std::shared_ptr<ModelDataProducer> pModelData = std::make_shared<ModelDataProducer>();
+		pModelData->produce(pModel, pRotation, mConfig.pairNum, mConfig.sigma, mConfig.translateLen, rng);
+		return pModelData;
+	}
+
+	//stream all the trials to the consumer in the order of the trial index,
+	//the parallel generation works on chunks to bound the memory
+	void generate(const Consumer &consumer)
+	{
+		const int chunkSize = 256;
+		std::vector<std::shared_ptr<ModelDataProducer>> vChunk;
+		for (int start = 0; start < mConfig.trialNum; start += chunkSize)
+		{
+			int end = std::min(start + chunkSize, mConfig.trialNum);
+			vChunk.assign(end - start, std::shared_ptr<ModelDataProducer>());
+			if (mConfig.parallel)
+			{
+				cv::parallel_for_(cv::Range(start, end), ChunkProducer(this, start, vChunk));
+			}
+			else
+			{
+				ChunkProducer(this, start, vChunk)(cv::Range(start, end));
+			}
+
+			for (int i = start; i < end; i++)
+			{
+				consumer(i, vChunk[i - start]);
+				vChunk[i - start].reset();
+			}
+		}
+	}
+
+	void generate(std::vector<std::shared_ptr<ModelDataProducer>> &vModelData)
+	{
+		vModelData.resize(mConfig.trialNum);
+		generate([&](int trial, const std::shared_ptr<ModelDataProducer> &pModelData)
+		{
+			vModelData[trial] = pModelData;
+		});
+	}
+
+	//write all the trials to the text file read by ModelDataProducer::readFromFile
+	void generate(const std::string &fileName)
+	{
+		std::ofstream fs(fileName, std::ios::out);
+		if (!fs.is_open())
+		{
+			std::cout << "Failed to open the file " << fileName << std::endl;
+			return;
+		}
+
+		fs << mConfig.trialNum << std::endl;
+		generate([&](int trial, const std::shared_ptr<ModelDataProducer> &pModelData)
+		{
+			pModelData->writeToFile(fs);
+		});
+		fs.close();
+	}
+
+	const SyntheticDataConfig &getConfig() const { return mConfig; }
+
+private:
+	class ChunkProducer : public cv::ParallelLoopBody
+	{
+	public:
+		ChunkProducer(const SyntheticDataFactory *pFactory, int start,
+					  std::vector<std::shared_ptr<ModelDataProducer>> &vChunk) :
+			mpFactory(pFactory), mStart(start), mvChunk(vChunk) {}
+
+		virtual void operator()(const cv::Range &range) const
+		{
+			for (int i = range.start; i < range.end; i++)
+			{
+				mvChunk[i - mStart] = mpFactory->produce(i);
+			}
+		}
+
+	private:
+		const SyntheticDataFactory *mpFactory;
+		int mStart;
+		std::vector<std::shared_ptr<ModelDataProducer>> &mvChunk;
+	};
+
+	SyntheticDataConfig mConfig;
+};
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <OpencvCommon.h>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <functional>
+
+//The results of the Monte-Carlo trials, one value for every (level, trial, model) job.
+//Every job writes its own slot, so the table is filled in the same way whatever the
+//number of threads and the order of the jobs are
+class TrialResultTable
+{
+public:
+	TrialResultTable(int levelNum, int trialNum, int modelNum) :
+		mLevelNum(levelNum), mTrialNum(trialNum), mModelNum(modelNum),
+		mvValue(size_t(levelNum) * trialNum * modelNum, 0) {}
+	~TrialResultTable() {}
+
+	double &at(int level, int trial, int model)
+	{
+		return mvValue[(size_t(level) * mTrialNum + trial) * mModelNum + model];
+	}
+
+	double at(int level, int trial, int model) const
+	{
+		return mvValue[(size_t(level) * mTrialNum + trial) * mModelNum + model];
+	}
+
+	//the values of all the trials of one model in one level, ordered by the trial index
+	std::vector<double> getTrials(int level, int model) const
+	{
+		std::vector<double> vTrial(mTrialNum);
+		for (int i = 0; i < mTrialNum; i++)
+		{
+			vTrial[i] = mvValue[(size_t(level) * mTrialNum + i) * mModelNum + model];
+		}
+		return vTrial;
+	}
+
+private:
+	int mLevelNum, mTrialNum, mModelNum;
+	std::vector<double> mvValue;
+};
+
+//Schedule the independent (level, trial, model) jobs of a Monte-Carlo sweep on all the cores.
+//The jobs are dealt to the workers as contiguous ranges (the models of a trial share the
+//same data), every worker pops its own queue from the front and steals from the back of
+//the others when it runs out of jobs
+class TrialRunner
+{
+public:
+	typedef std::function<void(int level, int trial, int model)> Job;
+
+	//threadNum <= 0 means using all the cores
+	TrialRunner(int threadNum = 0)
+	{
+		mThreadNum = threadNum > 0 ? threadNum : cv::getNumberOfCPUs();
+		mThreadNum = std::max(mThreadNum, 1);
+	}
+	~TrialRunner() {}
+
+	void run(int levelNum, int trialNum, int modelNum, const Job &job)
+	{
+		assert(levelNum >= 0 && trialNum >= 0 && modelNum >= 0);
+		int jobNum = levelNum * trialNum * modelNum;
+		if (jobNum == 0) return;
+
+		int threadNum = std::min(mThreadNum, jobNum);
+		std::vector<WorkQueue> vQueue(threadNum);
+		for (int t = 0; t < threadNum; t++)
+		{
+			int start = int(int64(jobNum) * t / threadNum);
+			int end = int(int64(jobNum) * (t + 1) / threadNum);
+			for (int j = start; j < end; j++)
+			{
+				vQueue[t].jobs.push_back(j);
+			}
+		}
+
+		auto worker = [&](int t)
+		{
+			int jobIdx;
+			while (_pop(vQueue, t, jobIdx) || _steal(vQueue, t, jobIdx))
+			{
+				int model = jobIdx % modelNum;
+				int trial = (jobIdx / modelNum) % trialNum;
+				int level = jobIdx / (modelNum * trialNum);
+				job(level, trial, model);
+			}
+		};
+
+		if (threadNum == 1)
+		{
+			worker(0);
+			return;
+		}
+
+		std::vector<std::thread> vThread;
+		for (int t = 0; t < threadNum; t++)
+		{
+			vThread.push_back(std::thread(worker, t));
+		}
+		for (size_t t = 0; t < vThread.size(); t++)
+		{
+			vThread[t].join();
+		}
+	}
+
+	int getThreadNum() const { return mThreadNum; }
+
+private:
+	struct WorkQueue
+	{
+		std::mutex mutex;
+		std::deque<int> jobs;
+	};
+
+	bool _pop(std::vector<WorkQueue> &vQueue, int t, int &jobIdx)
+	{
+		std::lock_guard<std::mutex> lock(vQueue[t].mutex);
+		if (vQueue[t].jobs.empty()) return false;
+		jobIdx = vQueue[t].jobs.front();
+		vQueue[t].jobs.pop_front();
+		return true;
+	}
+
+	//no job is added after the start, so an unsuccessful round over all
+	//the other queues means that there is nothing left to do
+	bool _steal(std::vector<WorkQueue> &vQueue, int t, int &jobIdx)
+	{
+		int threadNum = int(vQueue.size());
+		for (int k = 1; k < threadNum; k++)
+		{
+			WorkQueue &victim = vQueue[(t + k) % threadNum];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (victim.jobs.empty()) continue;
+			jobIdx = victim.jobs.back();
+			victim.jobs.pop_back();
+			return true;
+		}
+		return false;
+	}
+
+	int mThreadNum;
+};